@@ -21,8 +21,31 @@
 #include <fcntl.h>
 #include <time.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <regex.h>
+#include <stdint.h>
+#include <limits.h>
 
-#define DEBUG
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <new>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 #define CTRL_KEY(x) ((x) & 0x1f)
 
@@ -38,9 +61,34 @@ T min(T a, T b) {
 
 const char *VERSION = "0.0.1 alpha";
 const int MAXLINE = 1000;
-const int MAXLEN = 1000;
-const int MAXBUF = 128;
+const int MAXBUF = 4096;
+const size_t ADD_BLOCK_SIZE = 64 * 1024;
+const size_t INPUT_BUFFER = 64 * 1024;
+const int PASTE_TIMEOUT_READS = 10; // give up on a paste after 1s of silence
+const int ESCAPE_TIMEOUT = 100; // ms to wait for the rest of an escape sequence
+const int MESSAGE_TIMEOUT = 5000;
+const int DEFAULT_MAX_FPS = 60;
+const size_t SCAN_CHUNK = 1 << 20;
+const size_t REPLACE_BLOCK = 4 << 20; // replace-all writes its text into blocks of this size
+const size_t INDEX_IN_BACKGROUND = 1 << 20; // smaller files are indexed on the spot
+const size_t INDEX_WAIT_DISTANCE = 1 << 20; // scanning further than this waits for the indexer
+const size_t WORD_SAMPLE = 4096; // a block keeps a running word count every this many bytes
 const int TAB_SPACE_LENGTH = 4;
+const int ROW_CHUNK = 4096; // chars per chunk of a cached row
+const int HIGHLIGHT_MARGIN = 1024; // chars around the view that are searched for matches to mark
+const int WRAP_SPAN = 4096; // lines per span of the wrap index
+const int WRAP_BUDGET = 8; // ms spent measuring wrapped lines per turn of the event loop
+const int SYNTAX_LOOKBACK = 200; // lines lexed above the view when nothing is known about them
+const int LEX_PEEK = 256; // chars a lexer may look past the chunk it colors
+const int MAX_KEYWORD = 32;
+const size_t DEFAULT_UNDO_LIMIT = 64 << 20; // bytes of history kept for undo
+const int JOURNAL_SYNC_INTERVAL = 1000; // ms between group fsyncs of the journal
+const size_t JOURNAL_STREAM = 1 << 20; // inserts bigger than this go to the journal file directly
+const size_t IN_PLACE_SAVE_MIN = 64 << 20; // smaller files are always rewritten whole
+const int IN_PLACE_SAVE_RATIO = 8; // save in place while at most 1/8 of the file changed
+const size_t FOLLOW_READ_MAX = 4 << 20; // bytes read from a followed file per wakeup
+const size_t STREAM_BLOCK = 4 << 20; // a stream is read into blocks of this size
+const size_t OSC52_MAX = 16 << 20; // bytes handed to the system clipboard at most
 
 enum editor_keys {
     UP_LINE_FEED = -369,
@@ -54,69 +102,4024 @@ enum editor_keys {
     PAGE_DOWN,
     HOME,
     END,
-    DELETE
+    DELETE,
+    PASTE, // a bracketed paste, the text is in input.paste
+    SHIFT = 1 << 16 // added to a movement key pressed with shift
+};
+
+enum editor_timers {
+    TIMER_MESSAGE, // the message bar clears itself
+    TIMER_JOURNAL, // pending journal records get written and fsynced
+    TIMER_WRAP, // the wrap index measures lines it has not seen in the background
+    TIMER_COUNT
+};
+
+static void findNewlinesScalar(const char *data, size_t i, size_t end, std::vector<size_t> &out) {
+    while (i < end) {
+        const char *p = (const char *)memchr(data + i, '\n', end - i);
+        if (p == nullptr) break;
+        out.push_back(p - data);
+        i = p - data + 1;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+static void findNewlinesSSE2(const char *data, size_t i, size_t end, std::vector<size_t> &out) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= end; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+        while (mask) {
+            out.push_back(i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    findNewlinesScalar(data, i, end, out);
+}
+
+__attribute__((target("avx2")))
+static void findNewlinesAVX2(const char *data, size_t i, size_t end, std::vector<size_t> &out) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; i + 32 <= end; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, newline));
+        while (mask) {
+            out.push_back(i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    findNewlinesScalar(data, i, end, out);
+}
+#endif
+
+// appends the offset of every '\n' in data[begin, end) to out
+void findNewlines(const char *data, size_t begin, size_t end, std::vector<size_t> &out) {
+#ifdef HAVE_X86_SIMD
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) findNewlinesAVX2(data, begin, end, out);
+    else findNewlinesSSE2(data, begin, end, out);
+#else
+    findNewlinesScalar(data, begin, end, out);
+#endif
+}
+
+static inline bool isBlank(char ch) {
+    return ch == ' ' || (ch >= '\t' && ch <= '\r');
+}
+
+static size_t countWordStartsScalar(const char *data, size_t i, size_t end) {
+    size_t count = 0;
+    bool blank = i == 0 || isBlank(data[i - 1]);
+    for (; i < end; i++) {
+        bool now = isBlank(data[i]);
+        count += blank && !now;
+        blank = now;
+    }
+    return count;
+}
+
+// a word starts at every byte that is not blank and follows a blank one.
+// the vector versions load each window twice, shifted by one byte, to see
+// what precedes every byte
+#ifdef HAVE_X86_SIMD
+static inline __m128i blankMaskSSE2(__m128i bytes) {
+    __m128i control = _mm_sub_epi8(bytes, _mm_set1_epi8('\t'));
+    __m128i in_range = _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8('\r' - '\t')), control);
+    return _mm_or_si128(in_range, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')));
+}
+
+static size_t countWordStartsSSE2(const char *data, size_t i, size_t end) {
+    size_t count = 0;
+    if (i == 0 && end > 0) count += !isBlank(data[i++]);
+    for (; i + 16 <= end; i += 16) {
+        __m128i blank = blankMaskSSE2(_mm_loadu_si128((const __m128i *)(data + i)));
+        __m128i before = blankMaskSSE2(_mm_loadu_si128((const __m128i *)(data + i - 1)));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_andnot_si128(blank, before)));
+    }
+    return count + countWordStartsScalar(data, i, end);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blankMaskAVX2(__m256i bytes) {
+    __m256i control = _mm256_sub_epi8(bytes, _mm256_set1_epi8('\t'));
+    __m256i in_range = _mm256_cmpeq_epi8(_mm256_min_epu8(control, _mm256_set1_epi8('\r' - '\t')), control);
+    return _mm256_or_si256(in_range, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')));
+}
+
+__attribute__((target("avx2")))
+static size_t countWordStartsAVX2(const char *data, size_t i, size_t end) {
+    size_t count = 0;
+    if (i == 0 && end > 0) count += !isBlank(data[i++]);
+    for (; i + 32 <= end; i += 32) {
+        __m256i blank = blankMaskAVX2(_mm256_loadu_si256((const __m256i *)(data + i)));
+        __m256i before = blankMaskAVX2(_mm256_loadu_si256((const __m256i *)(data + i - 1)));
+        count += __builtin_popcount(_mm256_movemask_epi8(_mm256_andnot_si256(blank, before)));
+    }
+    return count + countWordStartsScalar(data, i, end);
+}
+#endif
+
+// number of words that start in data[begin, end); data[begin - 1] is looked
+// at to tell whether the first byte starts one
+size_t countWordStarts(const char *data, size_t begin, size_t end) {
+#ifdef HAVE_X86_SIMD
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) return countWordStartsAVX2(data, begin, end);
+    return countWordStartsSSE2(data, begin, end);
+#else
+    return countWordStartsScalar(data, begin, end);
+#endif
+}
+
+static size_t findStringScalar(const char *data, size_t i, size_t end, const char *needle, size_t length) {
+    const char *last = data + end - length;
+    for (const char *p = data + i; p <= last; p++) {
+        p = (const char *)memchr(p, needle[0], last - p + 1);
+        if (p == nullptr) break;
+        if (memcmp(p + 1, needle + 1, length - 1) == 0) return p - data;
+    }
+    return end;
+}
+
+// the vector versions look for the first and the last byte of the needle at
+// once and only compare the rest where both of them match
+#ifdef HAVE_X86_SIMD
+static size_t findStringSSE2(const char *data, size_t i, size_t end, const char *needle, size_t length) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[length - 1]);
+    for (; i + length - 1 + 16 <= end; i += 16) {
+        __m128i head = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i tail = _mm_loadu_si128((const __m128i *)(data + i + length - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (memcmp(data + at + 1, needle + 1, length - 1) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+    return findStringScalar(data, i, end, needle, length);
+}
+
+__attribute__((target("avx2")))
+static size_t findStringAVX2(const char *data, size_t i, size_t end, const char *needle, size_t length) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[length - 1]);
+    for (; i + length - 1 + 32 <= end; i += 32) {
+        __m256i head = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i tail = _mm256_loadu_si256((const __m256i *)(data + i + length - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (memcmp(data + at + 1, needle + 1, length - 1) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+    return findStringScalar(data, i, end, needle, length);
+}
+#endif
+
+// offset of the first occurrence of needle in data[begin, end), or end if there is none
+size_t findString(const char *data, size_t begin, size_t end, const char *needle, size_t length) {
+    if (length == 0 || begin >= end || end - begin < length) return end;
+#ifdef HAVE_X86_SIMD
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) return findStringAVX2(data, begin, end, needle, length);
+    return findStringSSE2(data, begin, end, needle, length);
+#else
+    return findStringScalar(data, begin, end, needle, length);
+#endif
+}
+
+static bool isAsciiScalar(const char *data, size_t i, size_t end) {
+    uint64_t high = 0;
+    for (; i + 8 <= end; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        high |= word;
+    }
+    for (; i < end; i++) high |= (unsigned char)data[i];
+    return (high & 0x8080808080808080ULL) == 0;
+}
+
+// the top bit of every byte goes into the mask, so all ASCII is a zero mask
+#ifdef HAVE_X86_SIMD
+static bool isAsciiSSE2(const char *data, size_t i, size_t end) {
+    __m128i high = _mm_setzero_si128();
+    for (; i + 16 <= end; i += 16) high = _mm_or_si128(high, _mm_loadu_si128((const __m128i *)(data + i)));
+    return _mm_movemask_epi8(high) == 0 && isAsciiScalar(data, i, end);
+}
+
+__attribute__((target("avx2")))
+static bool isAsciiAVX2(const char *data, size_t i, size_t end) {
+    __m256i high = _mm256_setzero_si256();
+    for (; i + 32 <= end; i += 32) high = _mm256_or_si256(high, _mm256_loadu_si256((const __m256i *)(data + i)));
+    return _mm256_movemask_epi8(high) == 0 && isAsciiScalar(data, i, end);
+}
+#endif
+
+// whether data[0, length) is all 7-bit ASCII
+bool isAscii(const char *data, size_t length) {
+#ifdef HAVE_X86_SIMD
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) return isAsciiAVX2(data, 0, length);
+    return isAsciiSSE2(data, 0, length);
+#else
+    return isAsciiScalar(data, 0, length);
+#endif
+}
+
+static size_t findTabOrUtf8Scalar(const char *data, size_t i, size_t end) {
+    while (i < end && data[i] != '\t' && (unsigned char)data[i] < 0x80) i++;
+    return i;
+}
+
+// the first byte of data[0, length) that does not take exactly one column
+// by itself: a tab, or a byte of a UTF-8 char. lines are short, so SSE2 is
+// as wide as it gets, and the last window overlaps the one before instead
+// of leaving a tail
+#ifdef HAVE_X86_SIMD
+static inline unsigned tabOrUtf8Mask(const char *data) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)data);
+    return _mm_movemask_epi8(_mm_or_si128(bytes, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t'))));
+}
+#endif
+
+size_t findTabOrUtf8(const char *data, size_t length) {
+#ifdef HAVE_X86_SIMD
+    if (length >= 16) {
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16) {
+            unsigned mask = tabOrUtf8Mask(data + i);
+            if (mask) return i + __builtin_ctz(mask);
+        }
+        if (i == length) return length;
+        unsigned mask = tabOrUtf8Mask(data + length - 16);
+        return mask ? length - 16 + __builtin_ctz(mask) : length;
+    }
+#endif
+    return findTabOrUtf8Scalar(data, 0, length);
+}
+
+static inline bool isContinuation(char ch) {
+    return (ch & 0xc0) == 0x80;
+}
+
+// decodes the UTF-8 char at s[0], with n bytes available. returns its length
+// and sets *codepoint; a byte that does not start a valid sequence (a stray
+// continuation, a cut off or overlong sequence, a surrogate) is a char of
+// its own with codepoint -1
+int utf8Decode(const char *s, int n, int *codepoint) {
+    unsigned char ch = s[0];
+    *codepoint = ch;
+    if (ch < 0x80) return 1;
+    int length = ch >= 0xf0 ? 4 : ch >= 0xe0 ? 3 : ch >= 0xc0 ? 2 : 0;
+    static const int smallest[] = {0, 0, 0x80, 0x800, 0x10000};
+    int value = ch & (0x7f >> length);
+    *codepoint = -1;
+    if (length == 0 || ch > 0xf4 || length > n) return 1;
+    for (int i = 1; i < length; i++) {
+        if (!isContinuation(s[i])) return 1;
+        value = value << 6 | (s[i] & 0x3f);
+    }
+    if (value < smallest[length] || value > 0x10ffff || (value >= 0xd800 && value <= 0xdfff)) return 1;
+    *codepoint = value;
+    return length;
+}
+
+// [first, last] codepoint ranges, in order
+struct CodepointRange {
+    int first;
+    int last;
+};
+
+// combining marks, joiners and other chars that take no column of their own
+static const CodepointRange ZERO_WIDTH[] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf}, {0x05c1, 0x05c2},
+    {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a}, {0x064b, 0x065f}, {0x0670, 0x0670},
+    {0x06d6, 0x06dc}, {0x06df, 0x06e4}, {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0900, 0x0902},
+    {0x093a, 0x093a}, {0x093c, 0x093c}, {0x0941, 0x0948}, {0x094d, 0x094d}, {0x0951, 0x0957},
+    {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e}, {0x1160, 0x11ff}, {0x1ab0, 0x1aff},
+    {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e}, {0x2060, 0x2064}, {0x20d0, 0x20ff},
+    {0x302a, 0x302d}, {0x3099, 0x309a}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xfeff, 0xfeff},
+    {0xe0001, 0xe007f}, {0xe0100, 0xe01ef}
+};
+
+// East Asian wide and fullwidth chars, and emoji shown as pictures
+static const CodepointRange DOUBLE_WIDTH[] = {
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec}, {0x23f0, 0x23f0},
+    {0x23f3, 0x23f3}, {0x25fd, 0x25fe}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267f, 0x267f},
+    {0x2693, 0x2693}, {0x26a1, 0x26a1}, {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5},
+    {0x26ce, 0x26ce}, {0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f2, 0x26f3}, {0x26f5, 0x26f5},
+    {0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b}, {0x2728, 0x2728},
+    {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27b0, 0x27b0}, {0x27bf, 0x27bf}, {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55},
+    {0x2e80, 0x303e}, {0x3041, 0x3247}, {0x3250, 0x4dbf}, {0x4e00, 0xa4cf}, {0xa960, 0xa97f},
+    {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19}, {0xfe30, 0xfe6f}, {0xff00, 0xff60},
+    {0xffe0, 0xffe6}, {0x16fe0, 0x16fe4}, {0x17000, 0x18cff}, {0x1b000, 0x1b2ff}, {0x1f004, 0x1f004},
+    {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f251}, {0x1f260, 0x1f265},
+    {0x1f300, 0x1f320}, {0x1f32d, 0x1f335}, {0x1f337, 0x1f37c}, {0x1f37e, 0x1f393}, {0x1f3a0, 0x1f3ca},
+    {0x1f3cf, 0x1f3d3}, {0x1f3e0, 0x1f3f0}, {0x1f3f4, 0x1f3f4}, {0x1f3f8, 0x1f43e}, {0x1f440, 0x1f440},
+    {0x1f442, 0x1f4fc}, {0x1f4ff, 0x1f53d}, {0x1f54b, 0x1f54e}, {0x1f550, 0x1f567}, {0x1f57a, 0x1f57a},
+    {0x1f595, 0x1f596}, {0x1f5a4, 0x1f5a4}, {0x1f5fb, 0x1f64f}, {0x1f680, 0x1f6c5}, {0x1f6cc, 0x1f6cc},
+    {0x1f6d0, 0x1f6d2}, {0x1f6d5, 0x1f6d7}, {0x1f6eb, 0x1f6ec}, {0x1f6f4, 0x1f6fc}, {0x1f7e0, 0x1f7eb},
+    {0x1f90c, 0x1f93a}, {0x1f93c, 0x1f945}, {0x1f947, 0x1f9ff}, {0x1fa70, 0x1faff}, {0x20000, 0x2fffd},
+    {0x30000, 0x3fffd}
+};
+
+template<size_t N>
+static bool inRanges(const CodepointRange (&ranges)[N], int codepoint) {
+    const CodepointRange *it = std::upper_bound(ranges, ranges + N, codepoint, [](int cp, const CodepointRange &range) {
+        return cp < range.first;
+    });
+    return it != ranges && codepoint <= it[-1].last;
+}
+
+static int lookupWidth(int codepoint) {
+    if (codepoint < 0x20 || (codepoint >= 0x7f && codepoint < 0xa0)) return 1; // shown as '?'
+    if (inRanges(ZERO_WIDTH, codepoint)) return 0;
+    return inRanges(DOUBLE_WIDTH, codepoint) ? 2 : 1;
+}
+
+// columns a char takes on screen (tabs are up to the caller). widths in the
+// basic plane are cached in a table, as the width plus one once known
+int charWidth(int codepoint) {
+    static unsigned char table[0x10000];
+    if (codepoint >= 0x10000 || codepoint < 0) return lookupWidth(codepoint);
+    unsigned char &known = table[codepoint];
+    if (known == 0) known = lookupWidth(codepoint) + 1;
+    return known - 1;
+}
+
+// a char that goes on top of the one before it instead of taking a column
+static inline bool isCombining(int codepoint) {
+    return codepoint >= 0x300 && charWidth(codepoint) == 0;
+}
+
+// lets the event loop know a background thread has news for it
+void editorWake();
+long long editorNow();
+
+// live bytes of what grows with the text, by what it is for. blocks and
+// pieces come and go on any thread, so these are atomic; the row cache, the
+// wrap index and the undo log count their own
+enum memory_kinds {
+    MEM_TEXT,   // heap blocks and the pieces that point into them
+    MEM_MAPPED, // mapped files: page cache rather than heap
+    MEM_INDEX,  // newline and word indexes of the blocks
+    MEM_KINDS
+};
+
+std::atomic<long long> memory_used[MEM_KINDS];
+
+void memoryAdd(int kind, long long bytes) {
+    memory_used[kind] += bytes;
+}
+
+// builds the newline index of a big block in the background: the block is cut
+// into one range per core, every range is scanned on its own thread, and the
+// per-range offsets are concatenated once all of them are done. the word
+// counts every WORD_SAMPLE bytes are taken on the same pass
+class LineIndexer {
+public:
+    const char *data;
+    size_t size;
+    std::vector<size_t> newlines; // valid once done
+    std::vector<size_t> word_marks; // valid once done, see TextBlock
+    std::atomic<size_t> scanned;
+    std::atomic<bool> done;
+    std::atomic<bool> cancelled;
+    std::thread thread;
+
+    LineIndexer(const char *data, size_t size):
+        data(data), size(size), scanned(0), done(false), cancelled(false) {
+        thread = std::thread(&LineIndexer::run, this);
+    }
+    ~LineIndexer() {
+        cancelled = true;
+        wait();
+    }
+
+    void wait() {
+        if (thread.joinable()) thread.join();
+    }
+
+    int progress() const {
+        return size ? scanned * 100 / size : 100;
+    }
+
+private:
+    void run() {
+        size_t workers = max(1u, std::thread::hardware_concurrency());
+        workers = min(workers, size / SCAN_CHUNK + 1);
+        std::vector<std::vector<size_t> > parts(workers), words(workers);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < workers; i++) {
+            // ranges start on a sample so that every sample is counted whole
+            size_t begin = size * i / workers / WORD_SAMPLE * WORD_SAMPLE;
+            size_t end = i + 1 == workers ? size : size * (i + 1) / workers / WORD_SAMPLE * WORD_SAMPLE;
+            threads.push_back(std::thread(&LineIndexer::scan, this, begin, end, &parts[i], &words[i]));
+        }
+        size_t total = 0;
+        for (size_t i = 0; i < workers; i++) {
+            threads[i].join();
+            total += parts[i].size();
+        }
+        if (cancelled) return;
+        newlines.reserve(total);
+        word_marks.reserve(size / WORD_SAMPLE + 1);
+        word_marks.push_back(0);
+        for (size_t i = 0; i < workers; i++) {
+            newlines.insert(newlines.end(), parts[i].begin(), parts[i].end());
+            std::vector<size_t>().swap(parts[i]);
+            for (size_t j = 0; j < words[i].size(); j++) word_marks.push_back(word_marks.back() + words[i][j]);
+        }
+        done = true;
+        editorWake();
+    }
+
+    void scan(size_t begin, size_t end, std::vector<size_t> *out, std::vector<size_t> *words) {
+        while (begin < end && !cancelled) {
+            size_t stop = min(end, begin + SCAN_CHUNK);
+            findNewlines(data, begin, stop, *out);
+            for (size_t i = begin; i + WORD_SAMPLE <= stop; i += WORD_SAMPLE) {
+                words->push_back(countWordStarts(data, i, i + WORD_SAMPLE));
+            }
+            size_t before = scanned.fetch_add(stop - begin);
+            // wake the UI once per percent so the status bar can follow
+            if (before * 100 / size != (before + stop - begin) * 100 / size) editorWake();
+            begin = stop;
+        }
+    }
+};
+
+// a chunk of text that never moves once written. the file we opened is one
+// block, and everything typed goes into append-only "add" blocks, so pieces
+// can point into them forever
+class TextBlock {
+public:
+    char *data;
+    size_t size;
+    size_t capacity;
+    bool mapped; // data is a read-only mmap of the file
+    std::vector<size_t> newlines; // offsets of every '\n' in [0, indexed)
+    size_t indexed;
+    std::vector<size_t> word_marks; // words that start before k * WORD_SAMPLE, as far as counted
+    LineIndexer *indexer; // background scan of the whole block, if any
+    size_t index_bytes; // what newlines and word_marks were last counted as
+    // [from, to) of a mapped block that the file no longer holds since it
+    // was patched in place, sorted and disjoint
+    std::vector<std::pair<size_t, size_t> > stale;
+    std::atomic<int> refs;
+
+    TextBlock(size_t capacity):
+        data(new char[capacity]), size(0), capacity(capacity), mapped(false),
+        indexed(0), indexer(nullptr), index_bytes(0), refs(0) {
+        memoryAdd(MEM_TEXT, capacity);
+    }
+    TextBlock(char *data, size_t size):
+        data(data), size(size), capacity(size), mapped(true),
+        indexed(0), indexer(nullptr), index_bytes(0), refs(0) {
+        memoryAdd(MEM_MAPPED, size);
+    }
+    ~TextBlock() {
+        delete indexer;
+        if (mapped) munmap(data, size);
+        else delete[] data;
+        memoryAdd(mapped ? MEM_MAPPED : MEM_TEXT, -(long long)capacity);
+        memoryAdd(MEM_INDEX, -(long long)index_bytes);
+    }
+
+    // the index vectors only grow in steps, so this is cheap to call after
+    // every scan
+    void accountIndex() {
+        size_t bytes = (newlines.capacity() + word_marks.capacity()) * sizeof(size_t);
+        if (bytes != index_bytes) memoryAdd(MEM_INDEX, (long long)bytes - (long long)index_bytes);
+        index_bytes = bytes;
+    }
+
+    size_t available() const {
+        return capacity - size;
+    }
+
+    // returns the offset the text landed at
+    size_t append(const char *str, size_t length) {
+        size_t at = size;
+        memcpy(data + size, str, length);
+        for (size_t i = 0; i < length; i++) {
+            if (str[i] == '\n') newlines.push_back(at + i);
+        }
+        size += length;
+        indexed = size;
+        accountIndex();
+        return at;
+    }
+
+    bool fullyIndexed() const {
+        return indexed == size;
+    }
+
+    // gives the pages of a mapped block that cover [from, to) private
+    // copies, so the file under them can be rewritten without the text
+    // changing. the mapping is MAP_PRIVATE: writing a byte copies its page.
+    // from then on [from, to) counts as stale
+    bool detach(size_t from, size_t to) {
+        to = min(to, size);
+        if (!mapped || from >= to) return true;
+        stale.push_back(std::make_pair(from, to));
+        std::sort(stale.begin(), stale.end());
+        size_t merged = 0;
+        for (size_t i = 1; i < stale.size(); i++) {
+            if (stale[i].first <= stale[merged].second) stale[merged].second = max(stale[merged].second, stale[i].second);
+            else stale[++merged] = stale[i];
+        }
+        stale.resize(merged + 1);
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t begin = from / page * page;
+        if (mprotect(data + begin, to - begin, PROT_READ | PROT_WRITE) == -1) return false;
+        for (size_t i = begin; i < to; i += page) {
+            volatile char *p = data + i;
+            *p = *p;
+        }
+        return mprotect(data + begin, to - begin, PROT_READ) == 0;
+    }
+
+    void startIndexing() {
+        if (indexer == nullptr && !fullyIndexed()) indexer = new LineIndexer(data, size);
+    }
+
+    // take over the background index once it is complete. returns false
+    // while it is still running, unless we are told to wait for it
+    bool finishIndexing(bool wait) {
+        if (indexer == nullptr) return false;
+        if (!wait && !indexer->done) return false;
+        indexer->wait();
+        newlines.swap(indexer->newlines);
+        word_marks.swap(indexer->word_marks);
+        indexed = size;
+        delete indexer;
+        indexer = nullptr;
+        accountIndex();
+        return true;
+    }
+
+    // a mapped file is only indexed as far as somebody has asked for;
+    // long jumps ahead wait for the background indexer instead
+    void indexTo(size_t offset) {
+        offset = min(offset, size);
+        if (indexer && offset > indexed + INDEX_WAIT_DISTANCE) finishIndexing(true);
+        while (indexed < offset) {
+            const char *p = (const char *)memchr(data + indexed, '\n', offset - indexed);
+            if (p == nullptr) {
+                indexed = offset;
+                break;
+            }
+            newlines.push_back(p - data);
+            indexed = p - data + 1;
+        }
+        accountIndex();
+    }
+
+    // scan until at least `count` newlines are known or the block runs out
+    void indexNewlines(size_t count) {
+        if (indexer && count > newlines.size() + INDEX_WAIT_DISTANCE / 64) finishIndexing(true);
+        while (newlines.size() < count && indexed < size) {
+            const char *p = (const char *)memchr(data + indexed, '\n', size - indexed);
+            if (p == nullptr) {
+                indexed = size;
+                break;
+            }
+            newlines.push_back(p - data);
+            indexed = p - data + 1;
+        }
+        accountIndex();
+    }
+
+    // index into newlines of the first '\n' at or after `offset`,
+    // valid once the block is indexed up to `offset`
+    size_t newlineRank(size_t offset) const {
+        size_t lo = 0, hi = newlines.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (newlines[mid] < offset) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    // number of '\n' in [from, to)
+    size_t countNewlines(size_t from, size_t to) {
+        indexTo(to);
+        return newlineRank(to) - newlineRank(from);
+    }
+
+    // offset of the k-th (0-based) '\n' at or after `from`
+    size_t nthNewline(size_t from, size_t k) {
+        indexTo(from);
+        size_t rank = newlineRank(from) + k;
+        indexNewlines(rank + 1);
+        return newlines[rank];
+    }
+
+    // number of words that start in [0, offset); the running counts are
+    // extended as far as needed, the rest is at most one sample of scanning
+    size_t wordStartsBefore(size_t offset) {
+        if (word_marks.empty()) word_marks.push_back(0);
+        size_t k = offset / WORD_SAMPLE;
+        while (word_marks.size() <= k) {
+            size_t from = (word_marks.size() - 1) * WORD_SAMPLE;
+            word_marks.push_back(word_marks.back() + countWordStarts(data, from, from + WORD_SAMPLE));
+        }
+        accountIndex();
+        return word_marks[k] + countWordStarts(data, k * WORD_SAMPLE, offset);
+    }
+
+    // words in [from, to) on their own: the first byte starts one unless it
+    // is blank, whatever comes before it
+    size_t countWords(size_t from, size_t to) {
+        if (from >= to) return 0;
+        return !isBlank(data[from]) + wordStartsBefore(to) - wordStartsBefore(from + 1);
+    }
+
+    void retain() {
+        refs++;
+    }
+
+    void release() {
+        if (--refs == 0) delete this;
+    }
+};
+
+class PieceNode;
+
+// reference-counted handle; nodes are immutable once built, so a tree can be
+// shared by several owners and edits only copy the path they touch
+class PieceRef {
+private:
+    PieceNode *node;
+public:
+    PieceRef(): node(nullptr) {}
+    explicit PieceRef(PieceNode *node);
+    PieceRef(const PieceRef &other);
+    ~PieceRef();
+    PieceRef &operator=(const PieceRef &other);
+
+    PieceNode *operator->() const {
+        return node;
+    }
+    PieceNode *get() const {
+        return node;
+    }
+    explicit operator bool() const {
+        return node != nullptr;
+    }
+};
+
+// one piece of the document: `length` bytes of `block` starting at `start`.
+// every node also sums up its subtree so we can find bytes and lines in
+// O(log n) and know the byte, line and word counts of the whole text
+class PieceNode {
+public:
+    std::atomic<int> refs;
+    PieceRef left;
+    PieceRef right;
+
+    TextBlock *block;
+    size_t start;
+    size_t length;
+    size_t lf; // number of '\n' in this piece
+    size_t words; // words in this piece taken on its own
+    bool starts_blank;
+    bool ends_blank;
+
+    size_t total_length;
+    size_t total_lf;
+    size_t total_words;
+    size_t total_pieces;
+    bool total_starts_blank;
+    bool total_ends_blank;
+
+    PieceNode(TextBlock *block, size_t start, size_t length):
+        refs(0), block(block), start(start), length(length) {
+        memoryAdd(MEM_TEXT, sizeof(PieceNode));
+        block->retain();
+        lf = block->countNewlines(start, start + length);
+        words = block->countWords(start, start + length);
+        starts_blank = isBlank(block->data[start]);
+        ends_blank = isBlank(block->data[start + length - 1]);
+        update();
+    }
+    // the same piece without the children, so nothing is counted again
+    PieceNode(const PieceNode &piece):
+        refs(0), block(piece.block), start(piece.start), length(piece.length),
+        lf(piece.lf), words(piece.words), starts_blank(piece.starts_blank), ends_blank(piece.ends_blank) {
+        memoryAdd(MEM_TEXT, sizeof(PieceNode));
+        block->retain();
+        update();
+    }
+    ~PieceNode() {
+        memoryAdd(MEM_TEXT, -(long long)sizeof(PieceNode));
+        block->release();
+    }
+
+    void update() {
+        total_length = length;
+        total_lf = lf;
+        total_words = words;
+        total_pieces = 1;
+        total_starts_blank = starts_blank;
+        total_ends_blank = ends_blank;
+        // a word that runs across two pieces was counted in both
+        if (left) {
+            total_length += left->total_length;
+            total_lf += left->total_lf;
+            total_words += left->total_words - (!left->total_ends_blank && !starts_blank);
+            total_pieces += left->total_pieces;
+            total_starts_blank = left->total_starts_blank;
+        }
+        if (right) {
+            total_length += right->total_length;
+            total_lf += right->total_lf;
+            total_words += right->total_words - (!ends_blank && !right->total_starts_blank);
+            total_pieces += right->total_pieces;
+            total_ends_blank = right->total_ends_blank;
+        }
+    }
 };
 
-class EditorRow {
+PieceRef::PieceRef(PieceNode *node): node(node) {
+    if (node) node->refs++;
+}
+
+PieceRef::PieceRef(const PieceRef &other): node(other.node) {
+    if (node) node->refs++;
+}
+
+PieceRef::~PieceRef() {
+    if (node && --node->refs == 0) delete node;
+}
+
+PieceRef &PieceRef::operator=(const PieceRef &other) {
+    PieceRef copy(other);
+    PieceNode *temp = node;
+    node = copy.node;
+    copy.node = temp;
+    return *this;
+}
+
+// a persistent treap of pieces ordered by their position in the document.
+// a merge picks its root at random, weighted by the pieces on either side,
+// rather than by priorities stored in the nodes: subtrees are shared and
+// pasted back more than once, and copies of the same priorities would let
+// the tree grow deep
+class PieceTree {
+private:
+    PieceRef root;
+
+    static unsigned randomNumber() {
+        static unsigned seed = 2463534242u;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    static size_t lengthOf(const PieceRef &t) {
+        return t ? t->total_length : 0;
+    }
+
+    static size_t lfOf(const PieceRef &t) {
+        return t ? t->total_lf : 0;
+    }
+
+    static PieceRef makeNode(TextBlock *block, size_t start, size_t length,
+                             const PieceRef &left, const PieceRef &right) {
+        PieceNode *node = new PieceNode(block, start, length);
+        node->left = left;
+        node->right = right;
+        node->update();
+        return PieceRef(node);
+    }
+
+    static PieceRef withChildren(const PieceRef &t, const PieceRef &left, const PieceRef &right) {
+        PieceNode *node = new PieceNode(*t.get());
+        node->left = left;
+        node->right = right;
+        node->update();
+        return PieceRef(node);
+    }
+
+    static PieceRef merge(const PieceRef &a, const PieceRef &b) {
+        if (!a) return b;
+        if (!b) return a;
+        if (randomNumber() % (a->total_pieces + b->total_pieces) < a->total_pieces) {
+            return withChildren(a, a->left, merge(a->right, b));
+        } else {
+            return withChildren(b, merge(a, b->left), b->right);
+        }
+    }
+
+    // bytes before `at` go to l, the rest to r; a piece straddling `at` is cut in two
+    static void split(const PieceRef &t, size_t at, PieceRef &l, PieceRef &r) {
+        if (!t) {
+            l = r = PieceRef();
+            return;
+        }
+        size_t left_length = lengthOf(t->left);
+        if (at <= left_length) {
+            PieceRef mid;
+            split(t->left, at, l, mid);
+            r = withChildren(t, mid, t->right);
+        } else if (at >= left_length + t->length) {
+            PieceRef mid;
+            split(t->right, at - left_length - t->length, mid, r);
+            l = withChildren(t, t->left, mid);
+        } else {
+            size_t cut = at - left_length;
+            l = makeNode(t->block, t->start, cut, t->left, PieceRef());
+            r = makeNode(t->block, t->start + cut, t->length - cut, PieceRef(), t->right);
+        }
+    }
+
+    // grow the last piece of t by `extra` bytes, when the new text directly
+    // follows it in the same block (the common case while typing)
+    static PieceRef extendLast(const PieceRef &t, size_t extra) {
+        if (t->right) return withChildren(t, t->left, extendLast(t->right, extra));
+        return makeNode(t->block, t->start, t->length + extra, t->left, PieceRef());
+    }
+
+    static const PieceNode *last(const PieceRef &t) {
+        const PieceNode *node = t.get();
+        while (node && node->right) node = node->right.get();
+        return node;
+    }
+
+public:
+    size_t length() const {
+        return lengthOf(root);
+    }
+
+    size_t newlines() const {
+        return lfOf(root);
+    }
+
+    size_t words() const {
+        return root ? root->total_words : 0;
+    }
+
+    void clear() {
+        root = PieceRef();
+    }
+
+    void insert(size_t at, TextBlock *block, size_t start, size_t length) {
+        if (length == 0) return;
+        PieceRef l, r;
+        split(root, at, l, r);
+        const PieceNode *prev = last(l);
+        if (prev && prev->block == block && prev->start + prev->length == start) {
+            l = extendLast(l, length);
+        } else {
+            l = merge(l, makeNode(block, start, length, PieceRef(), PieceRef()));
+        }
+        root = merge(l, r);
+    }
+
+    void erase(size_t at, size_t length) {
+        if (length == 0) return;
+        PieceRef l, mid, removed, r;
+        split(root, at, l, mid);
+        split(mid, length, removed, r);
+        root = merge(l, r);
+    }
+
+    // the pieces of [at, at + length) as a tree of their own. it shares
+    // every node but those on the paths to the two ends, so it costs
+    // O(log n) however long the range is
+    PieceTree slice(size_t at, size_t length) const {
+        PieceRef l, mid, r;
+        split(root, at, l, mid);
+        PieceTree out;
+        split(mid, length, out.root, r);
+        return out;
+    }
+
+    // splices all pieces of other in at `at`, in O(log n) as well
+    void insertTree(size_t at, const PieceTree &other) {
+        if (!other.root) return;
+        PieceRef l, r;
+        split(root, at, l, r);
+        root = merge(merge(l, other.root), r);
+    }
+
+    // offset just past the `n`-th '\n' (1-based), i.e. the start of line n
+    size_t offsetAfterNewline(size_t n) const {
+        size_t offset = 0;
+        const PieceNode *node = root.get();
+        while (node) {
+            size_t left_lf = lfOf(node->left);
+            if (n <= left_lf) {
+                node = node->left.get();
+                continue;
+            }
+            n -= left_lf;
+            offset += lengthOf(node->left);
+            if (n <= node->lf) {
+                return offset + node->block->nthNewline(node->start, n - 1) - node->start + 1;
+            }
+            n -= node->lf;
+            offset += node->length;
+            node = node->right.get();
+        }
+        return offset;
+    }
+
+    // number of '\n' in [0, offset)
+    size_t newlinesBefore(size_t offset) const {
+        size_t count = 0;
+        const PieceNode *node = root.get();
+        while (node) {
+            size_t left_length = lengthOf(node->left);
+            if (offset < left_length) {
+                node = node->left.get();
+                continue;
+            }
+            offset -= left_length;
+            count += lfOf(node->left);
+            if (offset <= node->length) {
+                return count + node->block->countNewlines(node->start, node->start + offset);
+            }
+            offset -= node->length;
+            count += node->lf;
+            node = node->right.get();
+        }
+        return count;
+    }
+
+    // calls f(TextBlock *, size_t start, size_t length) for the part of every
+    // piece that lies in [from, to)
+    template<class F>
+    void forEachPiece(size_t from, size_t to, F f) const {
+        forEachPiece(root.get(), 0, from, to, f);
+    }
+
+    // calls f(const char *, size_t) for every run of bytes in [from, to)
+    template<class F>
+    void forEachChunk(size_t from, size_t to, F f) const {
+        forEachPiece(from, to, [&](TextBlock *block, size_t start, size_t length) {
+            f(block->data + start, length);
+        });
+    }
+
+private:
+    template<class F>
+    static void forEachPiece(const PieceNode *node, size_t base, size_t from, size_t to, F &f) {
+        while (node && from < to) {
+            size_t left_length = lengthOf(node->left);
+            size_t piece_begin = base + left_length;
+            size_t piece_end = piece_begin + node->length;
+            if (from < piece_begin) forEachPiece(node->left.get(), base, from, to, f);
+            size_t begin = max(from, piece_begin), end = min(to, piece_end);
+            if (begin < end) f(node->block, node->start + (begin - piece_begin), end - begin);
+            if (to <= piece_end) return;
+            base = piece_end;
+            node = node->right.get();
+        }
+    }
+};
+
+// the text of the buffer, stored as a piece table
+class Document {
+private:
+    PieceTree tree;
+    TextBlock *add_block;
+    // while the opened file is untouched we read straight from its block and
+    // index it lazily. an edit only moves the text up to it into the piece
+    // tree; the rest of the block, from `tail` on, follows the tree as it is
+    // until the block is indexed, so editing never waits for the index
+    TextBlock *lazy;
+    size_t tail;
+
+    // the tree holds at least the first `to` bytes afterwards. a piece needs
+    // its line count, so what is left of a block that is still being
+    // indexed stays where it is
+    void materialize(size_t to) {
+        if (lazy == nullptr) return;
+        size_t length = tree.length();
+        bool whole = lazy->indexer == nullptr || lazy->finishIndexing(false);
+        size_t end = whole ? lazy->size : min(lazy->size, tail + (max(to, length) - length));
+        tree.insert(length, lazy, tail, end - tail);
+        tail = end;
+        if (tail < lazy->size) return;
+        lazy->release();
+        lazy = nullptr;
+        tail = 0;
+    }
+
+    // number of '\n' in the tail before `offset` of the block
+    size_t tailNewlinesBefore(size_t offset) const {
+        lazy->indexTo(offset);
+        return lazy->newlineRank(offset) - lazy->newlineRank(tail);
+    }
+
+public:
+    Document(): add_block(nullptr), lazy(nullptr), tail(0) {}
+    // a copy is a snapshot that shares all text with the original, so it
+    // costs O(1). another thread may read it while nobody edits it
+    Document(const Document &other):
+        tree(other.tree), add_block(other.add_block), lazy(other.lazy), tail(other.tail) {
+        if (add_block) add_block->retain();
+        if (lazy) lazy->retain();
+    }
+    ~Document() {
+        tree.clear();
+        if (add_block) add_block->release();
+        if (lazy) lazy->release();
+    }
+
+    size_t size() const {
+        return tree.length() + (lazy ? lazy->size - tail : 0);
+    }
+
+    // a trailing '\n' ends the last line rather than starting a new one.
+    // while the file is still being indexed this is a lower bound
+    int lineCount() const {
+        size_t length = size();
+        if (length == 0) return 0;
+        if (lazy && !lazy->fullyIndexed()) return tree.newlines() + tailNewlinesBefore(lazy->indexed) + 1;
+        size_t newlines = tree.newlines() + (lazy ? tailNewlinesBefore(lazy->size) : 0);
+        return newlines + (charAt(length - 1) != '\n');
+    }
+
+    // number of '\n' in the whole text
+    size_t newlines() const {
+        return tree.newlines() + (lazy ? tailNewlinesBefore(lazy->size) : 0);
+    }
+
+    bool lineCountExact() const {
+        return lazy == nullptr || lazy->fullyIndexed();
+    }
+
+    // std::string::npos while the file is still being indexed
+    size_t wordCount() const {
+        if (lazy && lazy->indexer) return std::string::npos;
+        size_t words = tree.words();
+        if (lazy && tail < lazy->size) {
+            words += lazy->countWords(tail, lazy->size);
+            // a word that runs from the tree into the tail was counted twice
+            if (tree.length() && !isBlank(charAt(tree.length() - 1)) && !isBlank(lazy->data[tail])) words--;
+        }
+        return words;
+    }
+
+    // make sure the first `count` lines are known
+    void ensureLines(int count) {
+        int before = tree.newlines();
+        if (lazy && count > before) lazy->indexNewlines(lazy->newlineRank(tail) + count - before);
+    }
+
+    // percentage of the background line index, or -1 when not indexing
+    int indexProgress() const {
+        return lazy && lazy->indexer ? lazy->indexer->progress() : -1;
+    }
+
+    // adopt the background line index if it has finished. an edited
+    // document then takes the rest of the block into its tree
+    bool pollIndex() {
+        if (lazy == nullptr || !lazy->finishIndexing(false)) return false;
+        if (tail > 0 || tree.length() > 0) materialize(size());
+        return true;
+    }
+
+    size_t lineStart(int line) const {
+        if (line <= 0) return 0;
+        size_t before = tree.newlines();
+        if (lazy && (size_t)line > before) {
+            size_t n = lazy->newlineRank(tail) + line - before;
+            lazy->indexNewlines(n);
+            return tree.length() + (n <= lazy->newlines.size() ? lazy->newlines[n - 1] + 1 : lazy->size) - tail;
+        }
+        return tree.offsetAfterNewline(line);
+    }
+
+    // end of the line, not including its '\n'
+    size_t lineEnd(int line) const {
+        size_t before = tree.newlines();
+        if ((size_t)line < before) return tree.offsetAfterNewline(line + 1) - 1;
+        if (lazy) {
+            size_t n = lazy->newlineRank(tail) + line - before;
+            lazy->indexNewlines(n + 1);
+            return tree.length() + (n < lazy->newlines.size() ? lazy->newlines[n] : lazy->size) - tail;
+        }
+        return tree.length();
+    }
+
+    int lineOf(size_t offset) const {
+        size_t length = tree.length();
+        if (lazy && offset > length) return tree.newlines() + tailNewlinesBefore(tail + offset - length);
+        return tree.newlinesBefore(offset);
+    }
+
+    char charAt(size_t offset) const {
+        char ch = '\0';
+        forEachChunk(offset, offset + 1, [&](const char *str, size_t) {
+            ch = *str;
+        });
+        return ch;
+    }
+
+    template<class F>
+    void forEachChunk(size_t from, size_t to, F f) const {
+        forEachPiece(from, to, [&](TextBlock *block, size_t start, size_t length) {
+            f(block->data + start, length);
+        });
+    }
+
+    // like forEachChunk, but tells which block the bytes live in
+    template<class F>
+    void forEachPiece(size_t from, size_t to, F f) const {
+        size_t length = tree.length();
+        if (from < length) tree.forEachPiece(from, min(to, length), f);
+        if (lazy == nullptr) return;
+        from = max(from, length);
+        to = min(to, size());
+        if (from < to) f(lazy, tail + from - length, to - from);
+    }
+
+    // calls f(offset) for each occurrence of needle inside [from, to), in
+    // order and without overlaps, until f returns false. a match can span
+    // pieces, so the last bytes of every piece are carried over to the next
+    template<class F>
+    void forEachMatch(size_t from, size_t to, const std::string &needle, F f) const {
+        size_t m = needle.size();
+        if (m == 0) return;
+        std::string seam; // the last m - 1 bytes before the current piece
+        size_t seam_start = from, next = from;
+        bool done = false;
+        auto report = [&](size_t at) {
+            if (at < next) return;
+            next = at + m;
+            done = !f(at);
+        };
+        forEachChunk(from, to, [&](const char *str, size_t length) {
+            if (done) return;
+            size_t base = seam_start + seam.size();
+            if (!seam.empty()) {
+                size_t carried = seam.size();
+                seam.append(str, min(length, m - 1));
+                size_t i = 0;
+                while (!done && (i = findString(seam.data(), i, seam.size(), needle.data(), m)) < carried) {
+                    report(seam_start + i);
+                    i++;
+                }
+                seam.resize(carried);
+            }
+            size_t i = next > base ? next - base : 0;
+            while (!done && (i = findString(str, i, length, needle.data(), m)) < length) {
+                report(base + i);
+                i = next - base;
+            }
+            if (length >= m - 1) {
+                seam.assign(str + length - (m - 1), m - 1);
+                seam_start = base + length - (m - 1);
+            } else {
+                seam.append(str, length);
+                if (seam.size() > m - 1) {
+                    seam_start += seam.size() - (m - 1);
+                    seam.erase(0, seam.size() - (m - 1));
+                }
+            }
+        });
+    }
+
+    // calls f(offset, str, length) for runs of whole lines in [from, to),
+    // without the '\n' that ends the run, until f returns false. a run is as
+    // long as a piece allows; a line that spans pieces is glued together and
+    // passed on its own
+    template<class F>
+    void forEachLines(size_t from, size_t to, F f) const {
+        std::string line;
+        size_t line_start = from, base = from;
+        bool done = false;
+        forEachChunk(from, to, [&](const char *str, size_t length) {
+            if (done) return;
+            size_t i = 0;
+            const char *p = (const char *)memchr(str, '\n', length);
+            if (p && !line.empty()) {
+                line.append(str, p - str);
+                done = !f(line_start, line.data(), line.size());
+                line.clear();
+                i = p - str + 1;
+                line_start = base + i;
+            }
+            // the rest of the piece up to its last '\n' goes in one run
+            const char *last = p ? (const char *)memrchr(str + i, '\n', length - i) : nullptr;
+            if (!done && last) {
+                done = !f(line_start, str + i, last - str - i);
+                i = last - str + 1;
+                line_start = base + i;
+            }
+            if (!done) line.append(str + i, length - i);
+            base += length;
+        });
+        if (!done && line_start < to) f(line_start, line.data(), line.size());
+    }
+
+    // offset of the first '\n' at or after `from`, or the size of the document
+    size_t findNewline(size_t from) const {
+        size_t found = size(), base = from;
+        forEachChunk(from, size(), [&](const char *str, size_t length) {
+            const char *p = found == size() ? (const char *)memchr(str, '\n', length) : nullptr;
+            if (p) found = base + (p - str);
+            base += length;
+        });
+        return found;
+    }
+
+    void read(size_t from, size_t to, std::string &out) const {
+        out.clear();
+        if (from >= to) return;
+        out.reserve(to - from);
+        forEachChunk(from, to, [&](const char *str, size_t length) {
+            out.append(str, length);
+        });
+    }
+
+    // the whole block becomes the content of the document
+    void load(TextBlock *block) {
+        block->retain(); // an empty block is freed on the way out
+        tree.clear();
+        if (lazy) lazy->release();
+        lazy = nullptr;
+        tail = 0;
+        if (block->fullyIndexed()) {
+            tree.insert(0, block, 0, block->size);
+        } else {
+            block->retain();
+            lazy = block;
+        }
+        block->release();
+    }
+
+    // the blocks, one after the other, become the content of the document.
+    // they have to be indexed
+    void load(const std::vector<TextBlock *> &blocks) {
+        tree.clear();
+        if (lazy) lazy->release();
+        lazy = nullptr;
+        tail = 0;
+        for (size_t i = 0; i < blocks.size(); i++) tree.insert(tree.length(), blocks[i], 0, blocks[i]->size);
+    }
+
+    void insert(size_t at, const char *str, size_t length) {
+        if (length == 0) return;
+        materialize(at);
+        if (add_block == nullptr || add_block->available() < length) {
+            if (add_block) add_block->release();
+            add_block = new TextBlock(max(ADD_BLOCK_SIZE, length));
+            add_block->retain();
+        }
+        size_t start = add_block->append(str, length);
+        tree.insert(at, add_block, start, length);
+    }
+
+    // makes `out` the text [from, to) of this document. the two share
+    // their pieces, so this costs O(log n) however much text it is
+    void copyTo(size_t from, size_t to, Document &out) {
+        materialize(to);
+        if (out.lazy) out.lazy->release();
+        out.lazy = nullptr;
+        out.tail = 0;
+        out.tree = tree.slice(from, to - from);
+    }
+
+    // splices all of `text` in at `at` without copying it
+    void insertDocument(size_t at, const Document &text) {
+        if (text.size() == 0) return;
+        materialize(at);
+        tree.insertTree(at, text.tree);
+        if (text.lazy) {
+            at += text.tree.length();
+            tree.insert(at, text.lazy, text.tail, text.lazy->size - text.tail);
+        }
+    }
+
+    // puts text that already lives in a block back into the document
+    // without copying it
+    void insertPiece(size_t at, TextBlock *block, size_t start, size_t length) {
+        if (length == 0) return;
+        materialize(at);
+        tree.insert(at, block, start, length);
+    }
+
+    void erase(size_t at, size_t length) {
+        materialize(at + length);
+        tree.erase(at, length);
+    }
+};
+
+// some bytes of a block. blocks never change, so a span stays valid for as
+// long as it holds a reference
+struct TextSpan {
+    TextBlock *block;
+    size_t start;
+    size_t length;
+};
+
+// one entry of the undo log: `length` bytes at `at` were inserted or erased
+struct UndoOp {
+    size_t at;
+    size_t length;
+    size_t first_span; // where its text is in the span arena
+    size_t span_count;
+    size_t text; // bytes of its text that live in memory of ours
+    unsigned long group; // the operations of one undo step share a group
+    bool insert;
+};
+
+// the edit history as a log of operations. text is never copied: whatever
+// an operation inserted or erased still lives in the blocks, so an operation
+// only keeps spans into them. spans and operations are appended to chunked
+// arenas and the oldest history is dropped from the front once it holds more
+// than `limit` bytes. text counts against that only while nothing but the
+// history keeps it: erased text, and inserted text once it is undone. the
+// newest step is kept whatever it holds. undo and redo cost O(size of the
+// operation)
+class UndoLog {
+private:
+    std::deque<UndoOp> ops;      // [0, done) can be undone, [done, size) redone
+    std::deque<TextSpan> spans;  // spans[i - span_base] is span i
+    size_t span_base;
+    size_t done;
+    unsigned long groups;
+    bool open;        // the last operation may still grow
+    int transaction;  // > 0 while several operations make up one step
+    bool transaction_started;
+
+    static size_t heldBytes(const TextSpan &span) {
+        // text in a mapped file costs no memory of ours
+        return span.block->mapped ? 0 : span.length;
+    }
+
+    // the text of op that only the history keeps: what it erased while it
+    // is done, what it inserted once it is undone
+    static size_t ownText(const UndoOp &op, bool undone) {
+        return op.insert == undone ? op.text : 0;
+    }
+
+    // op changes sides between done and undone
+    void moveText(const UndoOp &op, bool undone) {
+        size_t gained = ownText(op, undone), lost = ownText(op, !undone);
+        bytes += gained - lost;
+        text += gained - lost;
+    }
+
+    void addSpan(UndoOp &op, const TextSpan &span) {
+        span.block->retain();
+        spans.push_back(span);
+        op.span_count++;
+        op.text += heldBytes(span);
+        bytes += sizeof(TextSpan);
+    }
+
+    void releaseSpan(const TextSpan &span) {
+        bytes -= sizeof(TextSpan);
+        span.block->release();
+    }
+
+    void popFront() {
+        const UndoOp &op = ops.front();
+        for (size_t i = 0; i < op.span_count; i++) {
+            releaseSpan(spans.front());
+            spans.pop_front();
+            span_base++;
+        }
+        bytes -= sizeof(UndoOp) + ownText(op, false);
+        text -= ownText(op, false);
+        ops.pop_front();
+        done--;
+    }
+
+    void popBack() {
+        const UndoOp &op = ops.back();
+        for (size_t i = 0; i < op.span_count; i++) {
+            releaseSpan(spans.back());
+            spans.pop_back();
+        }
+        bytes -= sizeof(UndoOp) + ownText(op, ops.size() > done);
+        text -= ownText(op, ops.size() > done);
+        ops.pop_back();
+    }
+
+    // the spans of [at, at + length) in the document
+    void collect(const Document &document, size_t at, size_t length, std::vector<TextSpan> &out) {
+        out.clear();
+        document.forEachPiece(at, at + length, [&](TextBlock *block, size_t start, size_t length) {
+            TextSpan span = {block, start, length};
+            out.push_back(span);
+        });
+    }
+
+    // drop whole steps, oldest first, until we are within the limit or
+    // only the newest one is left
+    void trim() {
+        while (bytes > limit && done > 0 && ops.front().group != ops[done - 1].group) {
+            unsigned long group = ops.front().group;
+            while (ops.front().group == group) popFront();
+        }
+    }
+
+    void record(const Document &document, size_t at, size_t length, bool insert) {
+        if (replaying || length == 0) return;
+        while (ops.size() > done) popBack();
+        std::vector<TextSpan> added;
+        collect(document, at, length, added);
+
+        if (open && transaction == 0 && !ops.empty()) {
+            UndoOp &last = ops.back();
+            bool append = last.insert == insert && (insert ? at == last.at + last.length : at == last.at);
+            bool prepend = !last.insert && !insert && at + length == last.at;
+            if (append || prepend) {
+                size_t before = last.text;
+                if (prepend) {
+                    for (size_t i = 0; i < added.size(); i++) {
+                        added[i].block->retain();
+                        last.text += heldBytes(added[i]);
+                    }
+                    spans.insert(spans.begin() + (last.first_span - span_base), added.begin(), added.end());
+                    bytes += added.size() * sizeof(TextSpan);
+                    last.span_count += added.size();
+                    last.at = at;
+                } else {
+                    for (size_t i = 0; i < added.size(); i++) {
+                        TextSpan &tail = spans.back();
+                        // typing usually continues the piece it typed last time
+                        if (i == 0 && tail.block == added[i].block && tail.start + tail.length == added[i].start) {
+                            tail.length += added[i].length;
+                            last.text += heldBytes(added[i]);
+                        } else {
+                            addSpan(last, added[i]);
+                        }
+                    }
+                }
+                last.length += length;
+                if (!last.insert) {
+                    bytes += last.text - before;
+                    text += last.text - before;
+                }
+                trim();
+                return;
+            }
+        }
+
+        UndoOp op;
+        op.at = at;
+        op.length = length;
+        op.first_span = span_base + spans.size();
+        op.span_count = 0;
+        op.text = 0;
+        op.insert = insert;
+        if (transaction > 0 && transaction_started) {
+            op.group = groups;
+        } else {
+            op.group = ++groups;
+            transaction_started = transaction > 0;
+        }
+        for (size_t i = 0; i < added.size(); i++) addSpan(op, added[i]);
+        ops.push_back(op);
+        bytes += sizeof(UndoOp) + ownText(op, false);
+        text += ownText(op, false);
+        done++;
+        open = true;
+        trim();
+    }
+
+public:
+    bool replaying; // undo and redo edit the document without being logged
+    size_t limit;
+    size_t bytes; // memory of the history: its bookkeeping and the text only it keeps
+    size_t text; // the text part of bytes
+
+    UndoLog(): span_base(0), done(0), groups(0), open(false), transaction(0),
+        transaction_started(false), replaying(false), limit(DEFAULT_UNDO_LIMIT), bytes(0), text(0) {}
+    ~UndoLog() {
+        while (!ops.empty()) popBack();
+    }
+
+    // the history no longer fits the text, e.g. after a reload
+    void clear() {
+        while (!ops.empty()) popBack();
+        done = 0;
+        open = false;
+    }
+
+    // the next operation starts a new step instead of growing the last one
+    void seal() {
+        open = false;
+    }
+
+    // everything recorded until end() is undone in one step
+    void begin() {
+        if (transaction++ == 0) transaction_started = false;
+        open = false;
+    }
+    void end() {
+        transaction--;
+    }
+
+    // call after the text went in
+    void recordInsert(const Document &document, size_t at, size_t length) {
+        record(document, at, length, true);
+    }
+    // call before the text goes away
+    void recordErase(const Document &document, size_t at, size_t length) {
+        record(document, at, length, false);
+    }
+
+    // calls f(op, inverse) for the operations of the last step, newest
+    // first; f has to apply the inverse of each of them
+    template<class F>
+    bool undo(F f) {
+        if (done == 0) return false;
+        unsigned long group = ops[done - 1].group;
+        replaying = true;
+        while (done > 0 && ops[done - 1].group == group) {
+            done--;
+            moveText(ops[done], true);
+            f(ops[done], true);
+        }
+        replaying = false;
+        open = false;
+        return true;
+    }
+
+    template<class F>
+    bool redo(F f) {
+        if (done == ops.size()) return false;
+        unsigned long group = ops[done].group;
+        replaying = true;
+        while (done < ops.size() && ops[done].group == group) {
+            moveText(ops[done], false);
+            f(ops[done], false);
+            done++;
+        }
+        replaying = false;
+        open = false;
+        return true;
+    }
+
+    template<class F>
+    void forEachSpan(const UndoOp &op, F f) const {
+        for (size_t i = 0; i < op.span_count; i++) f(spans[op.first_span - span_base + i]);
+    }
+
+    size_t steps() const {
+        return ops.empty() ? 0 : ops.back().group - ops.front().group + 1;
+    }
+    size_t size() const {
+        return ops.size();
+    }
+};
+
+// one match of a SearchPattern. groups are relative to `line`, which holds
+// the text the match was found in
+struct SearchMatch {
+    size_t at;
+    size_t length;
+    const char *line;
+    regmatch_t groups[10];
+};
+
+// what we search for: a plain string, found with the vector search, or an
+// extended regular expression, which is matched one line at a time. a
+// regular expression without special characters is searched as plain text
+class SearchPattern {
+private:
+    std::string text;
+    bool regex;
+    bool compiled;
+    regex_t re;
+    char error[100];
+
+    void compile() {
+        compiled = false;
+        error[0] = '\0';
+        if (!regex) return;
+        int ret = regcomp(&re, text.c_str(), REG_EXTENDED | REG_NEWLINE);
+        if (ret != 0) regerror(ret, &re, error, sizeof(error));
+        else compiled = true;
+    }
+
+    void release() {
+        if (compiled) regfree(&re);
+        compiled = false;
+    }
+
+public:
+    SearchPattern(): regex(false), compiled(false) {
+        error[0] = '\0';
+    }
+    SearchPattern(const std::string &text, bool regex):
+        text(text), regex(regex && strpbrk(text.c_str(), ".[]()*+?{}|^$\\") != nullptr) {
+        compile();
+    }
+    // a copy gets a regex_t of its own; glibc serializes matching on a shared one
+    SearchPattern(const SearchPattern &other): text(other.text), regex(other.regex) {
+        compile();
+    }
+    SearchPattern &operator=(const SearchPattern &other) {
+        if (this == &other) return *this;
+        release();
+        text = other.text;
+        regex = other.regex;
+        compile();
+        return *this;
+    }
+    ~SearchPattern() {
+        release();
+    }
+
+    bool empty() const {
+        return text.empty();
+    }
+
+    // a bad regular expression matches nothing; this says why
+    const char *errorMessage() const {
+        return error[0] ? error : nullptr;
+    }
+
+    bool valid() const {
+        return !text.empty() && (!regex || compiled);
+    }
+
+    // the first match in line[from, length), which may hold several lines.
+    // `bol` says whether it starts at the start of a line of the document.
+    // empty matches are skipped
+    bool find(const char *line, size_t length, size_t from, SearchMatch &m, bool bol = true) const {
+        if (!valid()) return false;
+        m.line = line;
+        if (!regex) {
+            size_t at = findString(line, from, length, text.data(), text.size());
+            if (at == length) return false;
+            m.groups[0].rm_so = at;
+            m.groups[0].rm_eo = at + text.size();
+            m.groups[1].rm_so = -1;
+            return true;
+        }
+        while (from <= length) {
+            m.groups[0].rm_so = from;
+            m.groups[0].rm_eo = length;
+            int flags = REG_STARTEND | (bol ? 0 : REG_NOTBOL);
+            if (regexec(&re, line, 10, m.groups, flags) != 0) return false;
+            if (m.groups[0].rm_eo > m.groups[0].rm_so) return true;
+            from = m.groups[0].rm_so + 1;
+        }
+        return false;
+    }
+
+    // calls f(match) for each match that starts in [from, limit), in order
+    // and without overlaps, until f returns false. matches may run past
+    // `limit`, to the end of their line
+    template<class F>
+    void forEachMatch(const Document &document, size_t from, size_t limit, F f) const {
+        if (!valid() || from >= limit) return;
+        SearchMatch m;
+        if (!regex) {
+            m.line = text.data();
+            m.length = text.size();
+            m.groups[0].rm_so = 0;
+            m.groups[0].rm_eo = text.size();
+            m.groups[1].rm_so = -1;
+            document.forEachMatch(from, min(document.size(), limit + text.size() - 1), text, [&](size_t at) {
+                if (at >= limit) return false;
+                m.at = at;
+                return (bool)f(m);
+            });
+            return;
+        }
+        bool bol = from == 0 || document.charAt(from - 1) == '\n';
+        // REG_NEWLINE keeps matches inside their line, so the line that
+        // holds `limit` is the last one we need
+        size_t to = document.findNewline(limit - 1);
+        document.forEachLines(from, to, [&](size_t offset, const char *str, size_t length) {
+            size_t i = 0;
+            while (find(str, length, i, m, bol)) {
+                m.at = offset + m.groups[0].rm_so;
+                m.length = m.groups[0].rm_eo - m.groups[0].rm_so;
+                if (m.at >= limit || !f(m)) return false;
+                i = m.groups[0].rm_eo;
+            }
+            bol = true;
+            return true;
+        });
+    }
+
+    // the first match that starts in [from, limit), or std::string::npos
+    size_t find(const Document &document, size_t from, size_t limit) const {
+        size_t found = std::string::npos;
+        forEachMatch(document, from, limit, [&](const SearchMatch &m) {
+            found = m.at;
+            return false;
+        });
+        return found;
+    }
+
+    // the last match that starts in [from, limit), or std::string::npos.
+    // the range is scanned backwards a window at a time
+    size_t findLast(const Document &document, size_t from, size_t limit) const {
+        size_t end = limit;
+        while (end > from) {
+            size_t begin = end - min(end - from, SCAN_CHUNK);
+            size_t found = std::string::npos;
+            forEachMatch(document, begin, end, [&](const SearchMatch &m) {
+                found = m.at;
+                return true;
+            });
+            if (found != std::string::npos) return found;
+            end = begin;
+        }
+        return std::string::npos;
+    }
+
+    // appends the replacement for m: & stands for the whole match and \1
+    // to \9 for its groups, a backslash escapes the next character
+    void expand(const std::string &with, const SearchMatch &m, std::string &out) const {
+        for (size_t i = 0; i < with.size(); i++) {
+            int group = -1;
+            if (with[i] == '&') {
+                group = 0;
+            } else if (with[i] == '\\' && i + 1 < with.size()) {
+                i++;
+                if (with[i] >= '0' && with[i] <= '9') group = with[i] - '0';
+                else out += with[i];
+            } else {
+                out += with[i];
+            }
+            if (group < 0 || (group > 0 && !regex)) continue;
+            const regmatch_t &g = m.groups[group];
+            if (g.rm_so >= 0) out.append(m.line + g.rm_so, g.rm_eo - g.rm_so);
+        }
+    }
+};
+
+// the write-ahead journal of a file: a swap file next to it that describes
+// every edit since the file was last saved. an edit appends a small record
+// to a buffer in O(1); the buffer is written and fsynced as a group on a
+// timer, so autosave costs a few bytes per edit. when the editor finds a
+// journal for the version of the file it opens, it replays the records up
+// to the first torn or damaged one
+class Journal {
+private:
+    int fd;
+    std::string pending;
+    size_t end; // bytes in the file
+    size_t save_mark; // where the records made during a save begin
+    size_t save_records;
+    bool unsynced; // records were written around pending and wait for a sync
+
+    struct Header {
+        char magic[8];
+        uint64_t size; // the saved file the records apply to
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+    };
+
+    static uint32_t checksum(const char *data, size_t length, uint32_t hash = 2166136261u) {
+        // FNV-1a
+        for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+        return hash;
+    }
+
+    static Header headerFor(const struct stat &st) {
+        Header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "EZSWAP01", 8);
+        header.size = st.st_size;
+        header.mtime_sec = st.st_mtim.tv_sec;
+        header.mtime_nsec = st.st_mtim.tv_nsec;
+        return header;
+    }
+
+    void record(char type, size_t at, const char *str, size_t length) {
+        if (fd == -1) return;
+        size_t start = pending.size();
+        uint64_t fields[2] = {at, length};
+        pending += type;
+        pending.append((const char *)fields, sizeof(fields));
+        if (str) pending.append(str, length);
+        uint32_t sum = checksum(pending.data() + start, pending.size() - start);
+        pending.append((const char *)&sum, sizeof(sum));
+        records++;
+    }
+
+    bool writeOut(const char *data, size_t length) {
+        size_t done = 0;
+        while (done < length) {
+            ssize_t ret = write(fd, data + done, length - done);
+            if (ret == -1 && errno == EINTR) continue;
+            if (ret == -1) return false;
+            done += ret;
+        }
+        written += done;
+        end += done;
+        return true;
+    }
+
+    // an insert of a lot of text is written straight from where the text
+    // lives instead of being copied into pending. only its checksum waits
+    // in pending, so a crash before the next sync leaves a record that
+    // recover() stops at
+    void insertStreamed(size_t at, const std::vector<std::pair<const char *, size_t> > &parts) {
+        if (fd == -1) return;
+        size_t length = 0;
+        for (size_t i = 0; i < parts.size(); i++) length += parts[i].second;
+        char head[1 + 2 * sizeof(uint64_t)];
+        uint64_t fields[2] = {at, length};
+        head[0] = 'I';
+        memcpy(head + 1, fields, sizeof(fields));
+        uint32_t sum = checksum(head, sizeof(head));
+        bool ok = writeOut(pending.data(), pending.size()) && writeOut(head, sizeof(head));
+        pending.clear();
+        for (size_t i = 0; i < parts.size(); i++) {
+            sum = checksum(parts[i].first, parts[i].second, sum);
+            ok = ok && writeOut(parts[i].first, parts[i].second);
+        }
+        if (ok) pending.append((const char *)&sum, sizeof(sum));
+        records++;
+        unsynced = true;
+    }
+
+public:
+    std::string path;
+    size_t records; // since the last save
+    size_t written; // bytes
+    size_t syncs;
+    std::string kept; // where recover() moved a journal it could not replay
+
+    Journal(): fd(-1), end(0), save_mark(0), save_records(0), unsynced(false), records(0), written(0), syncs(0) {}
+    ~Journal() {
+        if (fd != -1) ::close(fd);
+    }
+
+    // moves the journal at from to the first free name from.1, from.2, ...
+    bool keepAside(const std::string &from) {
+        for (int i = 1; i < 1000; i++) {
+            std::string to = from + "." + std::to_string(i);
+            if (link(from.c_str(), to.c_str()) == 0) {
+                kept = to;
+                return unlink(from.c_str()) == 0;
+            }
+            if (errno != EEXIST) return false;
+        }
+        return false;
+    }
+
+    static std::string pathFor(const char *filename) {
+        std::string name(filename);
+        size_t slash = name.rfind('/');
+        size_t base = slash == std::string::npos ? 0 : slash + 1;
+        return name.substr(0, base) + "." + name.substr(base) + ".swp";
+    }
+
+    bool isOpen() const {
+        return fd != -1;
+    }
+
+    bool hasPending() const {
+        return !pending.empty() || unsynced;
+    }
+
+    // an empty journal for filename, which is in the state st
+    bool start(const char *filename, const struct stat &st) {
+        if (fd != -1) ::close(fd);
+        path = pathFor(filename);
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1) return false;
+        reset(st);
+        return true;
+    }
+
+    // the file was saved: nothing needs replaying any more
+    void reset(const struct stat &st) {
+        if (fd == -1) return;
+        pending.clear();
+        if (ftruncate(fd, 0) == -1 || lseek(fd, 0, SEEK_SET) == -1) return;
+        end = 0;
+        Header header = headerFor(st);
+        pending.append((const char *)&header, sizeof(header));
+        records = 0;
+        flush();
+    }
+
+    // a save is about to write out the text as it is now
+    void mark() {
+        save_mark = end + pending.size();
+        save_records = records;
+    }
+
+    // the save that started at mark() is done and st is the saved file.
+    // the records after the mark are edits made while it was writing, so
+    // they are kept on top of the new base
+    bool rebase(const struct stat &st) {
+        if (fd == -1) return true;
+        if (!flush()) return false;
+        std::string later(end - save_mark, '\0');
+        size_t done = 0;
+        while (done < later.size()) {
+            ssize_t ret = pread(fd, &later[done], later.size() - done, save_mark + done);
+            if (ret == -1 && errno == EINTR) continue;
+            if (ret <= 0) return false;
+            done += ret;
+        }
+        size_t kept = records - save_records;
+        reset(st);
+        pending += later;
+        records = kept;
+        return flush();
+    }
+
+    // the file grew at its end and so did the document, so the records
+    // replay just as well on the file as it is now, in state st. only the
+    // header moves on
+    bool retarget(const struct stat &st) {
+        if (fd == -1) return true;
+        Header header = headerFor(st);
+        if (end == 0) {
+            // not written out yet
+            pending.replace(0, sizeof(header), (const char *)&header, sizeof(header));
+            return true;
+        }
+        ssize_t ret;
+        do {
+            ret = pwrite(fd, &header, sizeof(header), 0);
+        } while (ret == -1 && errno == EINTR);
+        if (ret != (ssize_t)sizeof(header) || fdatasync(fd) == -1) return false;
+        syncs++;
+        return true;
+    }
+
+    void insert(size_t at, const char *str, size_t length) {
+        if (length > JOURNAL_STREAM) {
+            insertStreamed(at, std::vector<std::pair<const char *, size_t> >(1, std::make_pair(str, length)));
+            return;
+        }
+        record('I', at, str, length);
+    }
+
+    // text pasted as pieces of a document, which may be huge
+    void insert(size_t at, const Document &text) {
+        if (fd == -1) return;
+        if (text.size() <= JOURNAL_STREAM) {
+            std::string gathered;
+            text.read(0, text.size(), gathered);
+            record('I', at, gathered.data(), gathered.size());
+            return;
+        }
+        std::vector<std::pair<const char *, size_t> > parts;
+        text.forEachChunk(0, text.size(), [&](const char *str, size_t length) {
+            parts.push_back(std::make_pair(str, length));
+        });
+        insertStreamed(at, parts);
+    }
+
+    void erase(size_t at, size_t length) {
+        record('E', at, nullptr, length);
+    }
+
+    // writes the pending records and fsyncs them. false on an I/O error
+    bool flush() {
+        if (fd == -1 || !hasPending()) return true;
+        if (!writeOut(pending.data(), pending.size())) return false;
+        pending.clear();
+        unsynced = false;
+        if (fdatasync(fd) == -1) return false;
+        syncs++;
+        return true;
+    }
+
+    // the edits are safe elsewhere (saved or thrown away on purpose)
+    void remove() {
+        if (fd == -1) return;
+        ::close(fd);
+        fd = -1;
+        pending.clear();
+        unsynced = false;
+        unlink(path.c_str());
+    }
+
+    // replays the journal of filename, if it was written for the state st,
+    // through apply(type, at, str, length), which returns false for a
+    // record that does not fit. returns how many records were replayed, or
+    // -1 when there is nothing to recover. the journal stays open and later
+    // records are appended after the last good one.
+    // edits journaled for another state of the file can't be replayed, but
+    // they are not ours to throw away either: the journal is moved aside to
+    // `kept` and -1 returned, or -2 if it can't be moved
+    template<class F>
+    long long recover(const char *filename, const struct stat &st, F apply) {
+        std::string data;
+        kept.clear();
+        int in = open(pathFor(filename).c_str(), O_RDONLY);
+        if (in == -1) return -1;
+        char buf[64 * 1024];
+        ssize_t nread;
+        while ((nread = read(in, buf, sizeof(buf))) > 0) data.append(buf, nread);
+        ::close(in);
+        Header header = headerFor(st), found;
+        if (nread != -1 && data.size() < sizeof(found)) return -1;
+        if (nread != -1) memcpy(&found, data.data(), sizeof(found));
+        if (nread == -1 || memcmp(&found, &header, sizeof(header)) != 0) {
+            if (nread != -1 && data.size() == sizeof(header)) return -1; // no edits in it
+            return keepAside(pathFor(filename)) ? -1 : -2;
+        }
+
+        long long count = 0;
+        size_t pos = sizeof(header);
+        const size_t fixed = 1 + 2 * sizeof(uint64_t);
+        while (data.size() - pos >= fixed + sizeof(uint32_t)) {
+            char type = data[pos];
+            uint64_t fields[2];
+            memcpy(fields, data.data() + pos + 1, sizeof(fields));
+            size_t payload = type == 'I' ? fields[1] : 0;
+            if (payload > data.size() - pos - fixed - sizeof(uint32_t)) break;
+            size_t length = fixed + payload;
+            uint32_t sum;
+            memcpy(&sum, data.data() + pos + length, sizeof(sum));
+            if (sum != checksum(data.data() + pos, length)) break;
+            if ((type != 'I' && type != 'E') ||
+                !apply(type, fields[0], data.data() + pos + fixed, fields[1])) break;
+            pos += length + sizeof(sum);
+            count++;
+        }
+
+        path = pathFor(filename);
+        if (fd != -1) ::close(fd);
+        fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd == -1 || ftruncate(fd, pos) == -1 || lseek(fd, pos, SEEK_SET) == -1) return count;
+        end = pos;
+        records = count;
+        return count;
+    }
+};
+
+// counts the matches of a query on a snapshot of the document in the
+// background. the scan starts at `origin` and wraps around, so the first
+// match it finds is the one nearest to the cursor. the document is walked a
+// window at a time so that deleting the worker stops it right away
+class SearchWorker {
+public:
+    Document snapshot;
+    SearchPattern pattern;
+    size_t origin;
+    std::atomic<size_t> nearest; // std::string::npos until a match turns up
+    std::atomic<size_t> scanned;
+    std::atomic<bool> done;
+    std::atomic<bool> cancelled;
+    long long count; // valid once done
+    long long index; // 1-based number of the nearest match, valid once done
+    std::thread thread;
+
+    SearchWorker(const Document &document, const SearchPattern &pattern, size_t origin):
+        snapshot(document), pattern(pattern), origin(origin), nearest(std::string::npos),
+        scanned(0), done(false), cancelled(false), count(0), index(0) {
+        thread = std::thread(&SearchWorker::run, this);
+    }
+    ~SearchWorker() {
+        cancelled = true;
+        if (thread.joinable()) thread.join();
+    }
+
+    int progress() const {
+        size_t size = snapshot.size();
+        return size ? min<size_t>(scanned * 100 / size, 100) : 100;
+    }
+
+private:
+    void run() {
+        size_t size = snapshot.size();
+        long long after = scan(origin, size);
+        long long before = scan(0, origin);
+        if (cancelled) return;
+        count = after + before;
+        index = after ? before + 1 : 1;
+        done = true;
+        editorWake();
+    }
+
+    // counts the matches that start in [from, to)
+    long long scan(size_t from, size_t to) {
+        size_t size = snapshot.size();
+        long long found = 0;
+        size_t next = from;
+        for (size_t window = from; window < to && !cancelled; window += SCAN_CHUNK) {
+            size_t window_end = min(to, window + SCAN_CHUNK);
+            pattern.forEachMatch(snapshot, max(window, next), window_end, [&](const SearchMatch &m) {
+                if (cancelled) return false;
+                found++;
+                next = m.at + m.length;
+                if (nearest == std::string::npos) {
+                    nearest = m.at;
+                    editorWake();
+                }
+                return true;
+            });
+            size_t before = scanned.fetch_add(window_end - window);
+            if (before * 100 / size != (before + window_end - window) * 100 / size) editorWake();
+        }
+        return found;
+    }
+};
+
+// writes a snapshot of the document to a file in the background. the text
+// goes straight from the pieces to a temp file next to it with writev, a
+// window at a time, so nothing is copied and memory stays flat however big
+// the file is. the temp file is fsynced and renamed over the original, so a
+// crash leaves either the old file or the new one. a mapped original stays
+// readable after the rename since its inode lives on until we unmap it.
+//
+// when a big file is still the one we mapped (`base`) and only a few
+// extents of it changed in place or at the tail, the pieces that point at
+// base at their own offset are already on disk, unless an earlier save
+// patched the file there, and the rest is pwritten over the file instead. that is not atomic, so it is kept for files where
+// a full rewrite would cost far more than the edit
+class SaveWorker {
+public:
+    Document snapshot;
+    std::string path;
+    std::atomic<size_t> written;
+    std::atomic<size_t> total; // bytes to write
+    std::atomic<bool> done;
+    bool in_place; // valid once done
+    int error; // errno of the failure, 0 on success; valid once done
+    struct stat st; // the saved file, valid once done
+    std::thread thread;
+
+    // base is the mapped file as it was in state base_st, or nullptr
+    SaveWorker(const Document &document, const char *filename, TextBlock *base, const struct stat &base_st):
+        snapshot(document), written(0), total(document.size()), done(false), in_place(false), error(0),
+        base(base), base_st(base_st) {
+        if (base) base->retain();
+        // save through a symlink to what it points at
+        char *real = realpath(filename, nullptr);
+        path = real ? real : filename;
+        free(real);
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0666 & ~mask;
+        thread = std::thread(&SaveWorker::run, this);
+    }
+    ~SaveWorker() {
+        if (thread.joinable()) thread.join();
+        if (base) base->release();
+    }
+
+    int progress() const {
+        size_t size = total;
+        return size ? min<size_t>(written * 100 / size, 100) : 100;
+    }
+
+private:
+    mode_t mode; // for a new file
+    TextBlock *base;
+    struct stat base_st;
+    std::vector<std::pair<size_t, size_t> > extents; // [from, to) that differ from base
+
+    void run() {
+        std::string temp;
+        if (findExtents()) {
+            in_place = true;
+            error = saveInPlace();
+        } else {
+            error = save(temp);
+        }
+        if (error && !temp.empty()) unlink(temp.c_str());
+        done = true;
+        editorWake();
+    }
+
+    int save(std::string &temp) {
+        size_t slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : path.substr(0, max<size_t>(slash, 1));
+        size_t base = slash == std::string::npos ? 0 : slash + 1;
+        temp = path.substr(0, base) + "." + path.substr(base) + ".XXXXXX";
+        int fd = mkstemp(&temp[0]);
+        if (fd == -1) {
+            temp.clear();
+            return errno;
+        }
+        struct stat old;
+        if (stat(path.c_str(), &old) == 0) {
+            mode = old.st_mode & 07777;
+            if (fchown(fd, old.st_uid, old.st_gid) == -1) {
+                // not ours to give away, the file becomes ours
+            }
+        }
+        if (fchmod(fd, mode) == -1 || !writeAll(fd) || fsync(fd) == -1) {
+            int saved = errno;
+            close(fd);
+            return saved;
+        }
+        if (close(fd) == -1 || rename(temp.c_str(), path.c_str()) == -1) return errno;
+        temp.clear();
+        // make the rename itself durable
+        int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir_fd != -1) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+        if (stat(path.c_str(), &st) == -1) return errno;
+        return 0;
+    }
+
+    // true when the file on disk is still base and little enough of it
+    // changed to be worth patching
+    bool findExtents() {
+        struct stat now;
+        if (base == nullptr || stat(path.c_str(), &now) == -1 || now.st_dev != base_st.st_dev ||
+            now.st_ino != base_st.st_ino || now.st_size != base_st.st_size ||
+            now.st_mtim.tv_sec != base_st.st_mtim.tv_sec || now.st_mtim.tv_nsec != base_st.st_mtim.tv_nsec) {
+            return false;
+        }
+        size_t size = snapshot.size();
+        if (max(size, base->size) < IN_PLACE_SAVE_MIN) return false;
+        size_t offset = 0, dirty = 0;
+        auto mark = [&](size_t from, size_t to) {
+            if (!extents.empty() && extents.back().second == from) extents.back().second = to;
+            else extents.push_back(std::make_pair(from, to));
+            dirty += to - from;
+        };
+        snapshot.forEachPiece(0, size, [&](TextBlock *block, size_t start, size_t length) {
+            size_t end = offset + length;
+            if (block != base || start != offset) {
+                mark(offset, end);
+            } else {
+                // base is on disk here, except where an earlier save patched it
+                auto it = std::upper_bound(base->stale.begin(), base->stale.end(), std::make_pair(offset, SIZE_MAX));
+                if (it != base->stale.begin()) --it;
+                for (; it != base->stale.end() && it->first < end; ++it) {
+                    size_t from = max(it->first, offset), to = min(it->second, end);
+                    if (from < to) mark(from, to);
+                }
+            }
+            offset = end;
+        });
+        size_t cut = base->size > size ? base->size - size : 0;
+        if ((dirty + cut) * IN_PLACE_SAVE_RATIO > size) {
+            extents.clear();
+            return false;
+        }
+        total = dirty;
+        return true;
+    }
+
+    int saveInPlace() {
+        int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd == -1) return errno;
+        size_t size = snapshot.size();
+        // whatever still reads the old text of these bytes must keep seeing it
+        bool ok = base->detach(size, base->size);
+        for (size_t i = 0; ok && i < extents.size(); i++) ok = base->detach(extents[i].first, extents[i].second);
+        for (size_t i = 0; ok && i < extents.size(); i++) {
+            size_t offset = extents[i].first;
+            snapshot.forEachPiece(extents[i].first, extents[i].second, [&](TextBlock *block, size_t start, size_t length) {
+                if (ok) ok = writeAt(fd, block->data + start, length, offset);
+                offset += length;
+            });
+            size_t before = written.fetch_add(extents[i].second - extents[i].first);
+            if (before * 100 / total != written * 100 / total) editorWake();
+        }
+        if (ok && size < base->size) ok = ftruncate(fd, size) == 0;
+        if (ok) ok = fdatasync(fd) == 0 && fstat(fd, &st) == 0;
+        int saved = errno;
+        close(fd);
+        return ok ? 0 : saved;
+    }
+
+    static bool writeAt(int fd, const char *data, size_t length, size_t offset) {
+        while (length) {
+            ssize_t ret = pwrite(fd, data, length, offset);
+            if (ret == -1 && errno == EINTR) continue;
+            if (ret == -1) return false;
+            data += ret;
+            length -= ret;
+            offset += ret;
+        }
+        return true;
+    }
+
+    bool writeAll(int fd) {
+        size_t size = snapshot.size();
+        std::vector<iovec> iov;
+        for (size_t window = 0; window < size; window += SCAN_CHUNK) {
+            size_t window_end = min(size, window + SCAN_CHUNK);
+            iov.clear();
+            snapshot.forEachPiece(window, window_end, [&](TextBlock *block, size_t start, size_t length) {
+                iovec v = {block->data + start, length};
+                iov.push_back(v);
+            });
+            if (!writeVector(fd, iov)) return false;
+            size_t before = written.fetch_add(window_end - window);
+            if (before * 100 / size != (before + window_end - window) * 100 / size) editorWake();
+        }
+        return true;
+    }
+
+    // writev until all of iov is out, IOV_MAX vectors at a time
+    static bool writeVector(int fd, std::vector<iovec> &iov) {
+        size_t i = 0;
+        while (i < iov.size()) {
+            int count = min<size_t>(iov.size() - i, IOV_MAX);
+            ssize_t ret = writev(fd, &iov[i], count);
+            if (ret == -1 && errno == EINTR) continue;
+            if (ret == -1) return false;
+            size_t left = ret;
+            while (i < iov.size() && left >= iov[i].iov_len) left -= iov[i++].iov_len;
+            if (left) {
+                iov[i].iov_base = (char *)iov[i].iov_base + left;
+                iov[i].iov_len -= left;
+            }
+        }
+        return true;
+    }
+};
+
+// follows a file that another program appends to, like tail -F. inotify
+// wakes us when the file or its directory changes; we then look at the file
+// itself, so a burst of writes costs one read of whatever was appended. the
+// file counts as rotated when it was truncated in place (it shrank, or the
+// last bytes we read are not there any more because it grew back already)
+// or when its name stops pointing at the inode we read (renamed or deleted,
+// and maybe created again), once the old inode has nothing more to give
+class FileFollower {
+private:
+    int fd;
+    ino_t inode;
+    dev_t device;
+    std::string tail; // the last bytes we read
+
+    static const size_t TAIL = 64;
+
+    bool readAt(size_t at, size_t length, std::string &out) {
+        out.resize(length);
+        ssize_t ret;
+        do {
+            ret = pread(fd, &out[0], length, at);
+        } while (ret == -1 && errno == EINTR);
+        out.resize(max<ssize_t>(ret, 0));
+        return ret != -1;
+    }
+
+public:
+    std::string path;
+    int notify_fd; // polled by the event loop, -1 when not following
+    size_t offset; // how much of the file we have
+    struct stat st; // the file as of the last poll that read from it
+
+    enum { NOTHING, GREW, ROTATED };
+
+    FileFollower(): fd(-1), inode(0), device(0), notify_fd(-1), offset(0) {}
+    ~FileFollower() {
+        stop();
+    }
+
+    bool isOn() const {
+        return fd != -1;
+    }
+
+    // follow filename, of which we have the first `from` bytes
+    bool start(const char *filename, size_t from) {
+        stop();
+        path = filename;
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            stop();
+            return false;
+        }
+        inode = st.st_ino;
+        device = st.st_dev;
+        offset = from;
+        size_t keep = min(offset, TAIL);
+        readAt(offset - keep, keep, tail);
+        size_t slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : path.substr(0, max<size_t>(slash, 1));
+        notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (notify_fd == -1 ||
+            inotify_add_watch(notify_fd, path.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) == -1 ||
+            inotify_add_watch(notify_fd, dir.c_str(), IN_CREATE | IN_MOVED_TO) == -1) {
+            stop();
+            return false;
+        }
+        return true;
+    }
+
+    void stop() {
+        if (fd != -1) close(fd);
+        if (notify_fd != -1) close(notify_fd);
+        fd = notify_fd = -1;
+    }
+
+    // the events only tell us to look, so they are just thrown away
+    void drain() {
+        char buf[4096];
+        while (notify_fd != -1 && read(notify_fd, buf, sizeof(buf)) > 0);
+    }
+
+    // reads what the file grew by, up to FOLLOW_READ_MAX bytes, into a new
+    // block for the caller
+    int poll(TextBlock *&grown) {
+        if (fd == -1 || fstat(fd, &st) == -1) return NOTHING;
+        if ((size_t)st.st_size < offset) return ROTATED;
+        std::string was;
+        if (readAt(offset - tail.size(), tail.size(), was) && was != tail) return ROTATED;
+        size_t length = min<size_t>(st.st_size - offset, FOLLOW_READ_MAX);
+        if (length > 0) {
+            grown = new TextBlock(length);
+            ssize_t nread;
+            do {
+                nread = pread(fd, grown->data, length, offset);
+            } while (nread == -1 && errno == EINTR);
+            grown->size = max<ssize_t>(nread, 0);
+            offset += grown->size;
+            size_t last = min(grown->size, TAIL);
+            tail.append(grown->data + grown->size - last, last);
+            if (tail.size() > TAIL) tail.erase(0, tail.size() - TAIL);
+            return GREW;
+        }
+        // a name that is gone for now may come back, the directory watch will tell
+        struct stat now;
+        if (stat(path.c_str(), &now) == 0 && (now.st_ino != inode || now.st_dev != device)) return ROTATED;
+        return NOTHING;
+    }
+};
+
+// reads a stream that can't be mapped, like a pipe or stdin, on a background
+// thread: every read() goes straight into the free end of a block of its own.
+// the main thread takes what has arrived as spans and puts them at the end of
+// the document as pieces, so the text is never copied and the editor works
+// on whatever is there so far. a block only grows past what was handed over,
+// and its size is only ever set by the main thread, which is all the reading
+// of a block that the two threads share
+class StreamLoader {
+private:
+    int fd;
+    std::mutex lock;
+    std::vector<TextSpan> arrived; // each span holds a reference to its block
+    std::thread thread;
+
+    void run() {
+        TextBlock *block = nullptr;
+        size_t filled = 0;
+        while (true) {
+            if (block == nullptr || filled == block->capacity) {
+                if (block) block->release();
+                block = new TextBlock(STREAM_BLOCK);
+                block->retain();
+                filled = 0;
+            }
+            ssize_t nread = read(fd, block->data + filled, block->capacity - filled);
+            if (nread == -1 && errno == EINTR) continue;
+            if (nread <= 0) {
+                error = nread == -1 ? errno : 0;
+                break;
+            }
+            TextSpan span = {block, filled, (size_t)nread};
+            block->retain();
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                arrived.push_back(span);
+            }
+            filled += nread;
+            received += nread;
+            editorWake();
+        }
+        if (block) block->release();
+        done = true;
+        editorWake();
+    }
+
+public:
+    std::string name;
+    std::atomic<size_t> received;
+    std::atomic<bool> done;
+    int error; // errno of a failed read, valid once done
+    long long started;
+
+    StreamLoader(int fd, const char *name):
+        fd(fd), name(name), received(0), done(false), error(0), started(editorNow()) {
+        thread = std::thread(&StreamLoader::run, this);
+    }
+    ~StreamLoader() {
+        if (thread.joinable()) thread.join();
+        close(fd);
+        for (size_t i = 0; i < arrived.size(); i++) arrived[i].block->release();
+    }
+
+    // what arrived since the last call, in order; the caller owns the references
+    void take(std::vector<TextSpan> &out) {
+        out.clear();
+        std::lock_guard<std::mutex> guard(lock);
+        out.swap(arrived);
+    }
+
+    // bytes per second so far
+    double throughput() const {
+        return received * 1000.0 / max(1LL, editorNow() - started);
+    }
+};
+
+// text written into a run of blocks of REPLACE_BLOCK bytes. a block is
+// indexed as soon as it is full, on the thread that wrote it
+struct BlockWriter {
+    std::vector<TextBlock *> blocks;
+
+    void write(const char *str, size_t length) {
+        while (length > 0) {
+            if (blocks.empty() || blocks.back()->available() == 0) {
+                finish();
+                blocks.push_back(new TextBlock(REPLACE_BLOCK));
+            }
+            TextBlock *block = blocks.back();
+            size_t n = min(length, block->available());
+            memcpy(block->data + block->size, str, n);
+            block->size += n;
+            str += n;
+            length -= n;
+        }
+    }
+
+    void finish() {
+        if (blocks.empty()) return;
+        TextBlock *block = blocks.back();
+        findNewlines(block->data, block->indexed, block->size, block->newlines);
+        block->indexed = block->size;
+        block->wordStartsBefore(block->size);
+    }
+};
+
+// builds the whole text with every match of pattern replaced, as blocks
+// that go into `out` in order, and returns the number of matches. the
+// document is cut at line starts into one range per core, so no match spans
+// two ranges, and each range is rewritten on its own thread straight into
+// blocks of its own, so the text is written once. a range is only copied
+// once it or another one turned out to have a match
+long long replaceAll(const Document &document, const SearchPattern &pattern,
+                     const std::string &with, std::vector<TextBlock *> &out) {
+    size_t size = document.size();
+    size_t parts = max(1u, std::thread::hardware_concurrency());
+    parts = min(parts, size / SCAN_CHUNK + 1);
+    std::vector<size_t> cuts(parts + 1, size);
+    cuts[0] = 0;
+    for (size_t i = 1; i < parts; i++) {
+        cuts[i] = min(size, document.findNewline(max(cuts[i - 1], size * i / parts)) + 1);
+    }
+
+    std::vector<BlockWriter> writers(parts);
+    std::vector<long long> counts(parts, 0);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < parts; i++) {
+        threads.push_back(std::thread([&, i]() {
+            SearchPattern own(pattern);
+            BlockWriter &writer = writers[i];
+            auto copy = [&](const char *str, size_t length) {
+                writer.write(str, length);
+            };
+            std::string replacement;
+            size_t last = cuts[i];
+            own.forEachMatch(document, cuts[i], cuts[i + 1], [&](const SearchMatch &m) {
+                document.forEachChunk(last, m.at, copy);
+                replacement.clear();
+                own.expand(with, m, replacement);
+                writer.write(replacement.data(), replacement.size());
+                last = m.at + m.length;
+                counts[i]++;
+                return true;
+            });
+            if (counts[i] == 0) return;
+            document.forEachChunk(last, cuts[i + 1], copy);
+            writer.finish();
+        }));
+    }
+    long long count = 0;
+    for (size_t i = 0; i < parts; i++) {
+        threads[i].join();
+        count += counts[i];
+    }
+    if (count == 0) return 0;
+
+    // the ranges without a match go in as they are
+    threads.clear();
+    for (size_t i = 0; i < parts; i++) {
+        if (counts[i] > 0) continue;
+        threads.push_back(std::thread([&, i]() {
+            document.forEachChunk(cuts[i], cuts[i + 1], [&](const char *str, size_t length) {
+                writers[i].write(str, length);
+            });
+            writers[i].finish();
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+    for (size_t i = 0; i < parts; i++) {
+        out.insert(out.end(), writers[i].blocks.begin(), writers[i].blocks.end());
+    }
+    return count;
+}
+
+enum highlight_classes {
+    HL_NORMAL,
+    HL_COMMENT,
+    HL_KEYWORD,
+    HL_TYPE,
+    HL_STRING,
+    HL_NUMBER,
+    HL_KEY, // a key in YAML and JSON mappings, or of key=value in a log
+    HL_TIME, // the timestamp a log line starts with
+    HL_WARNING,
+    HL_ERROR,
+    HL_COUNT
+};
+
+// a lexer state is the mode the lexer is in, the class of a token that goes
+// on in the next chunk, a few flags, and for YAML the indentation of the
+// line a block scalar hangs off
+enum lex_modes {
+    LEX_NORMAL,
+    LEX_WORD,
+    LEX_STRING,
+    LEX_CHAR,
+    LEX_LINE_COMMENT,
+    LEX_BLOCK_COMMENT,
+    LEX_BLOCK_SCALAR
+};
+const int LEX_MODE = 0xf;
+const int LEX_CLASS_SHIFT = 4;
+const int LEX_CLASS = 0xf << LEX_CLASS_SHIFT;
+const int LEX_ESCAPE = 1 << 8; // a '\\' in a string, or a '*' in a block comment, was the last char
+const int LEX_CONTENT = 1 << 9; // the line had more than indentation so far
+const int LEX_BLOCK = 1 << 10; // YAML: a '|' or '>' starts a block scalar on the next line
+const int LEX_INDENT_SHIFT = 12;
+const int LEX_UNKNOWN = -1; // a line that was never lexed
+const int LEX_STALE = 1 << 30; // a line whose state was right before the lines above it changed
+
+static const size_t ARENA_CLASSES[] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+    384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+// rows are loaded and dropped all the time as the view moves, and most of
+// what they allocate is small. it comes from 64KB slabs, each cut into
+// blocks of one of the sizes above: a freed block goes on the free list of
+// its size, and a slab that holds nothing any more is given back in bulk by
+// reclaim(). bigger blocks come from the heap. only the main thread
+// touches rows, so nothing here is locked
+class RowArena {
+private:
+    struct Slab {
+        size_t used; // blocks handed out
+        size_t padding;
+    };
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    static const size_t SLAB = 64 * 1024;
+    static const int CLASSES = sizeof(ARENA_CLASSES) / sizeof(ARENA_CLASSES[0]);
+
+    std::vector<Slab *> slabs;
+    FreeBlock *free_blocks[CLASSES];
+    char *carve[CLASSES]; // the part of the newest slab of a size never handed out
+    char *carve_end[CLASSES];
+
+    static int classOf(size_t size) {
+        if (size <= 256) return size ? (size - 1) / 16 : 0;
+        int c = 16;
+        while (ARENA_CLASSES[c] < size) c++;
+        return c;
+    }
+
+    static Slab *slabOf(const void *p) {
+        return (Slab *)((uintptr_t)p & ~(uintptr_t)(SLAB - 1));
+    }
+
+public:
+    size_t live; // bytes handed out
+    size_t held; // bytes taken from the system
+    size_t trimmed; // held after the last reclaim()
+
+    RowArena(): live(0), held(0), trimmed(0) {
+        for (int c = 0; c < CLASSES; c++) {
+            free_blocks[c] = nullptr;
+            carve[c] = carve_end[c] = nullptr;
+        }
+    }
+    ~RowArena() {
+        for (size_t i = 0; i < slabs.size(); i++) free(slabs[i]);
+    }
+
+    void *allocate(size_t size) {
+        if (size > ARENA_CLASSES[CLASSES - 1]) {
+            void *p = malloc(size);
+            if (p == nullptr) throw std::bad_alloc();
+            live += size;
+            held += size;
+            return p;
+        }
+        int c = classOf(size);
+        size = ARENA_CLASSES[c];
+        void *p = free_blocks[c];
+        if (p) {
+            free_blocks[c] = free_blocks[c]->next;
+        } else {
+            if (carve[c] == nullptr || carve[c] + size > carve_end[c]) {
+                void *slab;
+                if (posix_memalign(&slab, SLAB, SLAB) != 0) throw std::bad_alloc();
+                ((Slab *)slab)->used = 0;
+                slabs.push_back((Slab *)slab);
+                held += SLAB;
+                carve[c] = (char *)slab + sizeof(Slab);
+                carve_end[c] = (char *)slab + SLAB;
+            }
+            p = carve[c];
+            carve[c] += size;
+        }
+        slabOf(p)->used++;
+        live += size;
+        return p;
+    }
+
+    void deallocate(void *p, size_t size) {
+        if (size > ARENA_CLASSES[CLASSES - 1]) {
+            free(p);
+            live -= size;
+            held -= size;
+            return;
+        }
+        int c = classOf(size);
+        FreeBlock *block = (FreeBlock *)p;
+        block->next = free_blocks[c];
+        free_blocks[c] = block;
+        slabOf(p)->used--;
+        live -= ARENA_CLASSES[c];
+    }
+
+    // gives back every slab that holds nothing. costs a walk over the free lists
+    void reclaim() {
+        trimmed = held;
+        for (int c = 0; c < CLASSES; c++) {
+            FreeBlock **link = &free_blocks[c];
+            while (*link) {
+                if (slabOf(*link)->used == 0) *link = (*link)->next;
+                else link = &(*link)->next;
+            }
+            if (carve[c] && slabOf(carve_end[c] - 1)->used == 0) carve[c] = carve_end[c] = nullptr;
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < slabs.size(); i++) {
+            if (slabs[i]->used == 0) {
+                free(slabs[i]);
+                held -= SLAB;
+            } else {
+                slabs[kept++] = slabs[i];
+            }
+        }
+        slabs.resize(kept);
+    }
+
+    // reclaims once the slabs hold a lot more than what is in use
+    void trim() {
+        if (held > 2 * live + 16 * SLAB && held != trimmed) reclaim();
+    }
+};
+
+RowArena row_arena;
+
+// lets the containers of a row allocate from row_arena
+template<class T>
+struct RowAllocator {
+    typedef T value_type;
+
+    RowAllocator() {}
+    template<class U>
+    RowAllocator(const RowAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        return (T *)row_arena.allocate(n * sizeof(T));
+    }
+    void deallocate(T *p, size_t n) {
+        row_arena.deallocate(p, n * sizeof(T));
+    }
+};
+
+template<class T, class U>
+bool operator==(const RowAllocator<T> &, const RowAllocator<U> &) {
+    return true;
+}
+
+template<class T, class U>
+bool operator!=(const RowAllocator<T> &, const RowAllocator<U> &) {
+    return false;
+}
+
+// chunk text up to 15 bytes is kept inside the string itself
+typedef std::basic_string<char, std::char_traits<char>, RowAllocator<char> > RowText;
+
+// a run of a row's text. how far a run moves the render column only depends
+// on where it starts through its first tab: `lead` chars come before that
+// tab, and `tail` columns follow the tab stop it jumps to (-1 without a tab).
+// so runs can be measured once and chained from any column in O(1). `hl`
+// has the highlight class of every char, lexed from `state`; it is cleared
+// when the text changes. the text is UTF-8 and a run never cuts a char in
+// two; an `ascii` run takes one column per byte but for tabs, the others
+// are decoded char by char
+struct RowChunk {
+    RowText text;
+    RowText hl; // empty until the row is highlighted
+    int state;
+    int lead;
+    int tail;
+    bool ascii;
+
+    RowChunk(): state(LEX_UNKNOWN), lead(0), tail(-1), ascii(true) {}
+
+    static int tabStop(int rx) {
+        return (rx / TAB_SPACE_LENGTH + 1) * TAB_SPACE_LENGTH;
+    }
+
+    // steps over the char at byte i that starts at column rx: returns its
+    // length in bytes and moves rx past it
+    int step(size_t i, int &rx) const {
+        unsigned char ch = text[i];
+        if (ch == '\t') {
+            rx = tabStop(rx);
+            return 1;
+        }
+        if (ascii || ch < 0x80) {
+            rx++;
+            return 1;
+        }
+        int codepoint;
+        int length = utf8Decode(&text[i], text.size() - i, &codepoint);
+        rx += charWidth(codepoint);
+        return length;
+    }
+
+    void measure() {
+        ascii = isAscii(text.data(), text.size());
+        const char *tab = (const char *)memchr(text.data(), '\t', text.size());
+        size_t stop = tab ? tab - text.data() : text.size();
+        lead = 0;
+        if (ascii) lead = stop;
+        else for (size_t i = 0; i < stop;) i += step(i, lead);
+        tail = -1;
+        if (tab == nullptr) return;
+        int rx = 0; // tab stops are multiples of the tab width, so start from 0
+        for (size_t i = stop + 1; i < text.size();) i += step(i, rx);
+        tail = rx;
+    }
+
+    // the render column after the UTF-8 text s[0, n) that starts at rx
+    static int advanceText(const char *s, size_t n, int rx) {
+        for (size_t i = 0; i < n;) {
+            int codepoint;
+            if (s[i] == '\t') {
+                rx = tabStop(rx);
+                i++;
+            } else {
+                i += utf8Decode(s + i, n - i, &codepoint);
+                rx += charWidth(codepoint);
+            }
+        }
+        return rx;
+    }
+
+    // where a run that starts at byte `from` of text should end to hold
+    // about ROW_CHUNK bytes without cutting a char
+    static size_t cut(const RowText &text, size_t from) {
+        size_t end = min(text.size(), from + ROW_CHUNK);
+        for (int extra = 0; extra < 3 && end < text.size() && isContinuation(text[end]); extra++) end++;
+        return end;
+    }
+
+    // the render column just past the run, if it starts at rx
+    int advance(int rx) const {
+        return tail < 0 ? rx + lead : tabStop(rx + lead) + tail;
+    }
+};
+
+// a lightweight view of one line of the document. rows are materialized only
+// when they are looked at, and edits patch the rows that are cached. the text
+// is kept in chunks of about ROW_CHUNK chars with the char index and the
+// render column every chunk starts at, so an edit only rewrites one chunk
+// and the prefix sums after it, and mapping between char index and render
+// column looks at one chunk. a line of any length renders just the window
+// that is on screen. highlighting is kept per chunk as well, so an edit is
+// lexed again from the chunk before it until the state at the start of a
+// chunk is what it was
+struct Syntax;
+
+class EditorRow {
+public:
+    size_t offset; // where the row starts in the document
+    int length;
+    int rlength;
+    std::vector<RowChunk, RowAllocator<RowChunk> > chunks; // never empty; only a blank row has an empty chunk
+    std::vector<int, RowAllocator<int> > starts;  // char index of every chunk, and length at the end
+    std::vector<int, RowAllocator<int> > columns; // render column of every chunk, and rlength at the end
+    size_t lex_from; // chunks from here on may have to be lexed again
+    int lex_end;     // lexer state at the end of the row
+
+    EditorRow():
+        offset(0), length(0), rlength(0), chunks(1), starts(2, 0), columns(2, 0),
+        lex_from(0), lex_end(LEX_UNKNOWN) {
+        chunks[0].measure();
+    }
+
+    void swap(EditorRow &other) {
+        std::swap(offset, other.offset);
+        std::swap(length, other.length);
+        std::swap(rlength, other.rlength);
+        std::swap(lex_from, other.lex_from);
+        std::swap(lex_end, other.lex_end);
+        chunks.swap(other.chunks);
+        starts.swap(other.starts);
+        columns.swap(other.columns);
+    }
+
+    void load(const Document &document, int line) {
+        offset = document.lineStart(line);
+        chunks.assign(1, RowChunk());
+        document.forEachChunk(offset, document.lineEnd(line), [&](const char *str, size_t length) {
+            while (length) {
+                // a full chunk takes up to 3 bytes more to finish the char it ends in
+                size_t size = chunks.back().text.size();
+                if (size >= (size_t)ROW_CHUNK && (!isContinuation(*str) || size >= (size_t)ROW_CHUNK + 3)) {
+                    chunks.push_back(RowChunk());
+                    continue;
+                }
+                RowText &text = chunks.back().text;
+                size_t take = size < (size_t)ROW_CHUNK ? min(length, ROW_CHUNK - size) : 1;
+                text.append(str, take);
+                str += take;
+                length -= take;
+            }
+        });
+        // CRLF files: keep the '\r' in the document but out of the way
+        RowText &last = chunks.back().text;
+        if (!last.empty() && last[last.size() - 1] == '\r') last.resize(last.size() - 1);
+        if (last.empty() && chunks.size() > 1) chunks.pop_back();
+        for (size_t k = 0; k < chunks.size(); k++) chunks[k].measure();
+        reindex(0);
+        lex_from = 0;
+    }
+
+    // recompute where the chunks start from the k-th one on
+    void reindex(size_t k) {
+        starts.resize(chunks.size() + 1);
+        columns.resize(chunks.size() + 1);
+        if (k == 0) starts[0] = columns[0] = 0;
+        for (; k < chunks.size(); k++) {
+            starts[k + 1] = starts[k] + chunks[k].text.size();
+            columns[k + 1] = chunks[k].advance(columns[k]);
+        }
+        length = starts.back();
+        rlength = columns.back();
+    }
+
+    // the chunk that holds char index x; the end of the row is in the last one
+    size_t chunkAt(int x) const {
+        return std::upper_bound(starts.begin() + 1, starts.end() - 1, x) - starts.begin() - 1;
+    }
+
+    // '\0' outside the row
+    char charAt(int x) const {
+        if (x < 0 || x >= length) return '\0';
+        size_t k = chunkAt(x);
+        return chunks[k].text[x - starts[k]];
+    }
+
+    // lexes what changed since the last time, with the row starting in
+    // `state`; returns the state at the end of the row
+    int highlight(const Syntax &syntax, int state);
+
+    // the render column of the char that byte x belongs to
+    int charToRender(int x) const {
+        x = max(0, min(x, length));
+        size_t k = chunkAt(x);
+        const RowChunk &chunk = chunks[k];
+        int rx = columns[k], local = x - starts[k];
+        if (chunk.ascii) {
+            for (int i = 0; i < local; i++) rx = chunk.text[i] == '\t' ? RowChunk::tabStop(rx) : rx + 1;
+            return rx;
+        }
+        for (int i = 0; i < local;) {
+            int before = rx;
+            i += chunk.step(i, rx);
+            if (i > local) return before;
+        }
+        return rx;
+    }
+
+    // the char shown at render column rx (a tab or a wide char covers several columns)
+    int renderToChar(int rx) const {
+        if (rx >= rlength) return length;
+        size_t k = std::upper_bound(columns.begin() + 1, columns.end() - 1, rx) - columns.begin() - 1;
+        const RowChunk &chunk = chunks[k];
+        int column = columns[k];
+        if (chunk.ascii) {
+            for (size_t i = 0; i < chunk.text.size(); i++) {
+                column = chunk.text[i] == '\t' ? RowChunk::tabStop(column) : column + 1;
+                if (column > rx) return starts[k] + i;
+            }
+            return starts[k + 1];
+        }
+        for (size_t i = 0; i < chunk.text.size();) {
+            size_t start = i;
+            i += chunk.step(i, column);
+            if (column > rx) return starts[k] + start;
+        }
+        return starts[k + 1];
+    }
+
+    // the codepoint at byte x and its length, or -1 and 1 for a stray byte
+    int decodeAt(int x, int *codepoint) const {
+        size_t k = chunkAt(x);
+        const RowChunk &chunk = chunks[k];
+        int local = x - starts[k];
+        if (chunk.ascii) {
+            *codepoint = chunk.text[local];
+            return 1;
+        }
+        return utf8Decode(&chunk.text[local], chunk.text.size() - local, codepoint);
+    }
+
+    // where the char that byte x belongs to starts, with the combining
+    // marks on top of a char counted as part of it
+    int snapChar(int x) const {
+        if (x >= length) return length;
+        while (true) {
+            size_t k = chunkAt(x);
+            const RowText &text = chunks[k].text;
+            int local = x - starts[k], back = 0, codepoint;
+            while (back < 3 && back < local && isContinuation(text[local - back])) back++;
+            if (back > 0 && !isContinuation(text[local - back])
+                && utf8Decode(&text[local - back], text.size() - local + back, &codepoint) > back) x -= back;
+            if (x == 0) return x;
+            decodeAt(x, &codepoint);
+            if (!isCombining(codepoint)) return x;
+            x--;
+        }
+    }
+
+    // the chars before and after the one at x, for the cursor
+    int prevChar(int x) const {
+        return x > 0 ? snapChar(min(x, length) - 1) : 0;
+    }
+
+    int nextChar(int x) const {
+        if (x >= length) return length;
+        int codepoint;
+        x = snapChar(x);
+        x += decodeAt(x, &codepoint);
+        while (x < length) {
+            int n = decodeAt(x, &codepoint);
+            if (!isCombining(codepoint)) break;
+            x += n;
+        }
+        return x;
+    }
+
+    // chunk k after an edit: split when it grew too long, merged into its
+    // neighbour when it got short
+    void normalize(size_t k) {
+        if (k >= chunks.size()) return;
+        if (chunks[k].text.size() > 2 * (size_t)ROW_CHUNK) {
+            std::vector<RowChunk, RowAllocator<RowChunk> > parts;
+            const RowText &text = chunks[k].text;
+            for (size_t i = 0, end; i < text.size(); i = end) {
+                end = RowChunk::cut(text, i);
+                parts.push_back(RowChunk());
+                parts.back().text.assign(text, i, end - i);
+                parts.back().measure();
+            }
+            chunks.erase(chunks.begin() + k);
+            chunks.insert(chunks.begin() + k, parts.begin(), parts.end());
+            return;
+        }
+        if (k + 1 < chunks.size() && chunks[k].text.size() + chunks[k + 1].text.size() <= (size_t)ROW_CHUNK) {
+            chunks[k].text += chunks[k + 1].text;
+            chunks[k].hl.clear();
+            chunks.erase(chunks.begin() + k + 1);
+        }
+        if (chunks[k].text.empty() && chunks.size() > 1) chunks.erase(chunks.begin() + k);
+        else chunks[k].measure();
+    }
+
+    // an edit near the border of chunks k - 1 and k may have cut a char in
+    // two: the continuation bytes chunk k starts with go back to chunk k - 1
+    void mend(size_t k) {
+        for (size_t moved = 0; k > 0 && k < chunks.size() && moved < 3;) {
+            RowText &text = chunks[k].text;
+            size_t n = 0;
+            while (moved + n < 3 && n < text.size() && isContinuation(text[n])) n++;
+            if (n == 0) return;
+            chunks[k - 1].text.append(text, 0, n);
+            chunks[k - 1].hl.clear();
+            chunks[k - 1].measure();
+            text.erase(0, n);
+            chunks[k].hl.clear();
+            moved += n;
+            if (!text.empty()) {
+                chunks[k].measure();
+                return;
+            }
+            // the chunk after an emptied one may go on with the same char
+            chunks.erase(chunks.begin() + k);
+        }
+    }
+
+    // chunk k changed. lexers look up to LEX_PEEK chars past the chunk
+    // they color either way, so the chunks that near are lexed again too
+    void touch(size_t k) {
+        chunks[k].hl.clear();
+        size_t back = k;
+        for (size_t seen = 0; back > 0 && seen < (size_t)LEX_PEEK; seen += chunks[back].text.size()) back--;
+        lex_from = min(lex_from, back);
+        for (size_t next = k + 1, seen = 0; next < chunks.size() && seen < (size_t)LEX_PEEK; next++) {
+            chunks[next].hl.clear();
+            seen += chunks[next].text.size();
+        }
+    }
+
+    void insert(int at, const char *s, int len) {
+        size_t k = chunkAt(at), count = chunks.size();
+        chunks[k].text.insert(at - starts[k], s, len);
+        touch(k);
+        chunks[k].measure();
+        normalize(k);
+        // the chunk that followed the edited one moved by the parts it was split into
+        mend(k + 1 + chunks.size() - count);
+        mend(k);
+        reindex(k > 0 ? k - 1 : 0);
+    }
+
+    void erase(int at, int len) {
+        size_t k = chunkAt(at);
+        int local = at - starts[k];
+        int take = min(len, (int)chunks[k].text.size() - local);
+        chunks[k].text.erase(local, take);
+        len -= take;
+        // whole chunks in between go at once, then the head of the last one
+        size_t end = k + 1;
+        while (len > 0 && (int)chunks[end].text.size() <= len) len -= chunks[end++].text.size();
+        chunks.erase(chunks.begin() + k + 1, chunks.begin() + end);
+        touch(k);
+        if (len > 0) {
+            chunks[k + 1].text.erase(0, len);
+            chunks[k + 1].hl.clear();
+            normalize(k + 1);
+        }
+        normalize(k);
+        for (size_t i = k + 3; i-- > k;) mend(i);
+        reindex(k > 0 ? k - 1 : 0);
+    }
+
+    // chars [from, to) of the row
+    void read(int from, int to, std::string &out) const {
+        out.clear();
+        for (size_t k = chunkAt(from); from < to && k < chunks.size(); k++) {
+            int end = min(to, starts[k + 1]);
+            out.append(chunks[k].text.data() + from - starts[k], end - from);
+            from = end;
+        }
+    }
+
+    // the render columns [from, from + width) of the row, and the highlight
+    // class of every column if `classes` is given
+    void render(int from, int width, std::string &out, std::string *classes = nullptr) const {
+        out.clear();
+        if (classes) classes->clear();
+        int x = renderToChar(from);
+        int rx = charToRender(x);
+        size_t k = chunkAt(x);
+        while (rx < from + width && x < length) {
+            if (x == starts[k + 1]) k++;
+            const RowChunk &chunk = chunks[k];
+            size_t i = x - starts[k];
+            char ch = chunk.text[i];
+            char hl = chunk.hl.size() == chunk.text.size() ? chunk.hl[i] : (char)HL_NORMAL;
+            int end = rx, size = chunk.step(i, end);
+            x += size;
+            if (size == 1 && (unsigned char)ch < 0x80) {
+                for (; rx < end; rx++) {
+                    if (rx < from || rx >= from + width) continue;
+                    out.push_back(ch == '\t' ? ' ' : iscntrl((unsigned char)ch) ? '?' : ch);
+                    if (classes) classes->push_back(hl);
+                }
+                continue;
+            }
+            int codepoint;
+            utf8Decode(&chunk.text[i], size, &codepoint);
+            if (end == rx) {
+                // a combining mark goes on top of the char before it
+                if (rx > from) out.append(&chunk.text[i], size);
+                continue;
+            }
+            if (rx >= from && end <= from + width) {
+                // stray bytes and C1 controls are shown as '?' like the C0 ones
+                if (codepoint >= 0xa0) out.append(&chunk.text[i], size);
+                else out.push_back('?');
+                if (classes) classes->append(end - rx, hl);
+                rx = end;
+                continue;
+            }
+            // a wide char cut by the edge of the window
+            for (; rx < end; rx++) {
+                if (rx < from || rx >= from + width) continue;
+                out.push_back(rx < from + width - 1 ? '<' : '>');
+                if (classes) classes->push_back(hl);
+            }
+        }
+    }
+};
+
+// the cached rows by line, with the rows and their map nodes in row_arena
+typedef std::map<int, EditorRow, std::less<int>, RowAllocator<std::pair<const int, EditorRow> > > RowCache;
+
+// what a lexer sees: the chars [from, to) of a row that it colors, and the
+// rest of the row around them to peek at
+struct LexText {
+    const EditorRow &row;
+    const char *text;
+    int from;
+    int to;
+
+    char operator[](int x) const {
+        return x >= from && x < to ? text[x - from] : row.charAt(x);
+    }
+};
+
+static inline bool isWordChar(char ch) {
+    return isalnum((unsigned char)ch) || ch == '_';
+}
+
+static inline int lexWith(int state, int mode, int cls) {
+    return (state & ~(LEX_MODE | LEX_CLASS | LEX_ESCAPE)) | mode | cls << LEX_CLASS_SHIFT;
+}
+
+static bool inList(const char *const *list, const char *word, int length, bool ignore_case = false) {
+    for (; *list; list++) {
+        if ((int)strlen(*list) != length) continue;
+        if (ignore_case ? strncasecmp(*list, word, length) == 0 : strncmp(*list, word, length) == 0) return true;
+    }
+    return false;
+}
+
+// goes on with the token the state is in from x, and returns where it ends
+static int lexContinue(int &state, const LexText &s, int x, unsigned char *hl) {
+    int mode = state & LEX_MODE;
+    unsigned char cls = mode == LEX_LINE_COMMENT || mode == LEX_BLOCK_COMMENT ? HL_COMMENT
+                      : mode == LEX_BLOCK_SCALAR ? HL_STRING : (state & LEX_CLASS) >> LEX_CLASS_SHIFT;
+    for (; x < s.to; x++) {
+        char ch = s.text[x - s.from];
+        if (mode == LEX_WORD && !isWordChar(ch) && !(cls == HL_NUMBER && ch == '.')) {
+            state = lexWith(state, LEX_NORMAL, 0);
+            return x;
+        }
+        hl[x - s.from] = cls;
+        bool after = state & LEX_ESCAPE;
+        state &= ~LEX_ESCAPE;
+        if (mode == LEX_STRING || mode == LEX_CHAR) {
+            if (after) continue;
+            if (ch == '\\') state |= LEX_ESCAPE;
+            else if (ch == (mode == LEX_STRING ? '"' : '\'')) {
+                state = lexWith(state, LEX_NORMAL, 0);
+                return x + 1;
+            }
+        } else if (mode == LEX_BLOCK_COMMENT) {
+            if (after && ch == '/') {
+                state = lexWith(state, LEX_NORMAL, 0);
+                return x + 1;
+            }
+            if (ch == '*') state |= LEX_ESCAPE;
+        }
+    }
+    return x;
+}
+
+// a word, or a number, colored as `classify` says. a word that goes on past
+// the chunk is carried into the next one with the same class
+static int lexWord(int &state, const LexText &s, int x, unsigned char *hl,
+                   unsigned char (*classify)(const char *, int)) {
+    bool number = isdigit((unsigned char)s[x]);
+    int end = x, limit = s.to + LEX_PEEK;
+    while (end < limit && (isWordChar(s[end]) || (number && s[end] == '.'))) end++;
+    unsigned char cls = HL_NUMBER;
+    if (!number) {
+        char word[MAX_KEYWORD];
+        int length = end - x;
+        cls = HL_NORMAL;
+        if (length <= MAX_KEYWORD) {
+            for (int i = 0; i < length; i++) word[i] = s[x + i];
+            cls = classify(word, length);
+        }
+    }
+    int stop = min(end, s.to);
+    memset(hl + x - s.from, cls, stop - x);
+    if (end > s.to) state = lexWith(state, LEX_WORD, cls);
+    return stop;
+}
+
+// the end of the string that starts at x, or -1 if it is not in sight
+static int lexStringEnd(const LexText &s, int x) {
+    char quote = s[x];
+    for (int i = x + 1; i < s.to + LEX_PEEK; i++) {
+        char ch = s[i];
+        if (ch == '\0' && i >= s.row.length) return -1;
+        if (ch == '\\') i++;
+        else if (ch == quote) return i + 1;
+    }
+    return -1;
+}
+
+// past spaces from x
+static int lexSkipBlanks(const LexText &s, int x) {
+    while (s[x] == ' ' || s[x] == '\t') x++;
+    return x;
+}
+
+static const char *const CPP_KEYWORDS[] = {
+    "alignas", "alignof", "asm", "auto", "break", "case", "catch", "class", "const", "const_cast",
+    "constexpr", "continue", "decltype", "default", "delete", "do", "dynamic_cast", "else", "enum",
+    "explicit", "export", "extern", "false", "final", "for", "friend", "goto", "if", "inline",
+    "mutable", "namespace", "new", "noexcept", "nullptr", "operator", "override", "private",
+    "protected", "public", "register", "reinterpret_cast", "return", "sizeof", "static",
+    "static_assert", "static_cast", "struct", "switch", "template", "this", "thread_local",
+    "throw", "true", "try", "typedef", "typeid", "typename", "union", "using", "virtual",
+    "volatile", "while", "NULL", nullptr
+};
+
+static const char *const CPP_TYPES[] = {
+    "bool", "char", "char16_t", "char32_t", "double", "float", "int", "long", "short", "signed",
+    "unsigned", "void", "wchar_t", "size_t", "ssize_t", "ptrdiff_t", "off_t", "int8_t", "int16_t",
+    "int32_t", "int64_t", "uint8_t", "uint16_t", "uint32_t", "uint64_t", "intptr_t", "uintptr_t",
+    "std", "string", "vector", "map", nullptr
+};
+
+static unsigned char classifyCpp(const char *word, int length) {
+    if (inList(CPP_KEYWORDS, word, length)) return HL_KEYWORD;
+    if (inList(CPP_TYPES, word, length)) return HL_TYPE;
+    return HL_NORMAL;
+}
+
+static int lexCpp(int state, const LexText &s, unsigned char *hl) {
+    int x = s.from;
+    while (x < s.to) {
+        if ((state & LEX_MODE) != LEX_NORMAL) {
+            x = lexContinue(state, s, x, hl);
+            continue;
+        }
+        char ch = s.text[x - s.from];
+        unsigned char *out = hl + x - s.from;
+        bool content = state & LEX_CONTENT;
+        if (ch != ' ' && ch != '\t') state |= LEX_CONTENT;
+        if (ch == '/' && s[x + 1] == '/') {
+            state = lexWith(state, LEX_LINE_COMMENT, 0);
+        } else if (ch == '/' && s[x + 1] == '*') {
+            // skip the '*' so that it can't end the comment too
+            *out = HL_COMMENT;
+            if (x + 1 < s.to) out[1] = HL_COMMENT;
+            state = lexWith(state, LEX_BLOCK_COMMENT, 0);
+            x = min(x + 2, s.to);
+        } else if (ch == '"' || ch == '\'') {
+            *out = HL_STRING;
+            state = lexWith(state, ch == '"' ? LEX_STRING : LEX_CHAR, HL_STRING);
+            x++;
+        } else if (ch == '#' && !content) {
+            // a preprocessor directive
+            *out = HL_KEYWORD;
+            state = lexWith(state, LEX_WORD, HL_KEYWORD);
+            x++;
+        } else if (isWordChar(ch)) {
+            x = lexWord(state, s, x, hl, classifyCpp);
+        } else {
+            *out = HL_NORMAL;
+            x++;
+        }
+    }
+    return state;
+}
+
+static unsigned char classifyJson(const char *word, int length) {
+    static const char *const constants[] = {"true", "false", "null", nullptr};
+    return inList(constants, word, length) ? HL_KEYWORD : HL_NORMAL;
+}
+
+// a string followed by ':' is a key
+static unsigned char lexStringClass(const LexText &s, int x) {
+    int end = lexStringEnd(s, x);
+    return end >= 0 && s[lexSkipBlanks(s, end)] == ':' ? HL_KEY : HL_STRING;
+}
+
+static int lexJson(int state, const LexText &s, unsigned char *hl) {
+    int x = s.from;
+    while (x < s.to) {
+        if ((state & LEX_MODE) != LEX_NORMAL) {
+            x = lexContinue(state, s, x, hl);
+            continue;
+        }
+        char ch = s.text[x - s.from];
+        unsigned char *out = hl + x - s.from;
+        if (ch == '"') {
+            *out = lexStringClass(s, x);
+            state = lexWith(state, LEX_STRING, *out);
+            x++;
+        } else if (ch == '-' && isdigit((unsigned char)s[x + 1])) {
+            *out = HL_NUMBER;
+            x++;
+        } else if (isWordChar(ch)) {
+            x = lexWord(state, s, x, hl, classifyJson);
+        } else {
+            *out = HL_NORMAL;
+            x++;
+        }
+    }
+    return state;
+}
+
+static unsigned char classifyYaml(const char *word, int length) {
+    static const char *const constants[] = {
+        "true", "false", "null", "yes", "no", "on", "off", "True", "False", "Null", "TRUE", "FALSE", "NULL", nullptr
+    };
+    return inList(constants, word, length) ? HL_KEYWORD : HL_NORMAL;
+}
+
+// a plain scalar that ends in ": " or in ':' at the end of the line is a
+// key. only the first thing on a line, or in a "- " item, can be one
+static int lexYamlKeyEnd(const LexText &s, int x) {
+    for (int i = x - 1; i >= 0 && i >= x - LEX_PEEK; i--) {
+        char ch = s[i];
+        if (ch != ' ' && ch != '\t' && ch != '-') return -1;
+        if (i == 0) break;
+    }
+    for (int i = x; i < s.to + LEX_PEEK && i < s.row.length; i++) {
+        char ch = s[i];
+        if (ch == '#' && (s[i - 1] == ' ' || s[i - 1] == '\t')) return -1;
+        if (ch == ':' && (i + 1 == s.row.length || s[i + 1] == ' ' || s[i + 1] == '\t')) return i;
+    }
+    return -1;
+}
+
+static int lexYaml(int state, const LexText &s, unsigned char *hl) {
+    int x = s.from;
+    if (x == 0 && (state & LEX_MODE) == LEX_BLOCK_SCALAR) {
+        // a block scalar goes on while lines are blank or indented deeper
+        int indent = lexSkipBlanks(s, 0);
+        if (indent < s.row.length && indent <= state >> LEX_INDENT_SHIFT) state = LEX_NORMAL;
+    }
+    while (x < s.to) {
+        if ((state & LEX_MODE) != LEX_NORMAL) {
+            x = lexContinue(state, s, x, hl);
+            continue;
+        }
+        char ch = s.text[x - s.from];
+        unsigned char *out = hl + x - s.from;
+        *out = HL_NORMAL;
+        if (ch == ' ' || ch == '\t') {
+            x++;
+            continue;
+        }
+        if (!(state & LEX_CONTENT)) {
+            // the indentation of the line is where it starts
+            state |= LEX_CONTENT | min(x, (1 << (30 - LEX_INDENT_SHIFT)) - 1) << LEX_INDENT_SHIFT;
+        }
+        bool blank_before = x == 0 || s[x - 1] == ' ' || s[x - 1] == '\t';
+        if (ch != '#') state &= ~LEX_BLOCK;
+        int key_end, indicators = x + 1;
+        while (s[indicators] && strchr("+-0123456789", s[indicators])) indicators++;
+        if (ch == '#' && blank_before) {
+            state = lexWith(state, LEX_LINE_COMMENT, 0);
+        } else if (x == 0 && (ch == '-' || ch == '.') && s[1] == ch && s[2] == ch) {
+            // "---" and "..." around documents
+            for (int i = x; i < min(x + 3, s.to); i++) hl[i - s.from] = HL_KEYWORD;
+            x = min(x + 3, s.to);
+        } else if (ch == '-' && (s[x + 1] == ' ' || s[x + 1] == '\0')) {
+            *out = HL_KEYWORD;
+            x++;
+        } else if ((ch == '|' || ch == '>') && blank_before && (s[lexSkipBlanks(s, indicators)] == '\0'
+                                                                || s[lexSkipBlanks(s, indicators)] == '#')) {
+            // a block scalar starts on the next line
+            int stop = min(indicators, s.to);
+            memset(out, HL_KEYWORD, stop - x);
+            state |= LEX_BLOCK;
+            x = stop;
+        } else if ((ch == '&' || ch == '*' || ch == '!') && blank_before) {
+            // anchors, aliases and tags
+            *out = HL_TYPE;
+            state = lexWith(state, LEX_WORD, HL_TYPE);
+            x++;
+        } else if ((key_end = lexYamlKeyEnd(s, x)) > x) {
+            if (ch == '"' || ch == '\'') {
+                *out = HL_KEY;
+                state = lexWith(state, ch == '"' ? LEX_STRING : LEX_CHAR, HL_KEY);
+                x++;
+            } else {
+                int stop = min(key_end, s.to);
+                memset(out, HL_KEY, stop - x);
+                x = stop;
+            }
+        } else if (ch == '"' || ch == '\'') {
+            *out = HL_STRING;
+            state = lexWith(state, ch == '"' ? LEX_STRING : LEX_CHAR, HL_STRING);
+            x++;
+        } else if (isWordChar(ch)) {
+            x = lexWord(state, s, x, hl, classifyYaml);
+        } else {
+            x++;
+        }
+    }
+    return state;
+}
+
+static unsigned char classifyLog(const char *word, int length) {
+    static const char *const errors[] = {"error", "err", "fatal", "critical", "crit", "panic", "severe", "emerg", "alert", nullptr};
+    static const char *const warnings[] = {"warn", "warning", nullptr};
+    static const char *const infos[] = {"info", "notice", nullptr};
+    static const char *const debugs[] = {"debug", "trace", "verbose", nullptr};
+    if (inList(errors, word, length, true)) return HL_ERROR;
+    if (inList(warnings, word, length, true)) return HL_WARNING;
+    if (inList(infos, word, length, true)) return HL_KEYWORD;
+    if (inList(debugs, word, length, true)) return HL_COMMENT;
+    return HL_NORMAL;
+}
+
+static int lexLog(int state, const LexText &s, unsigned char *hl) {
+    int x = s.from;
+    while (x < s.to) {
+        if ((state & LEX_MODE) != LEX_NORMAL) {
+            x = lexContinue(state, s, x, hl);
+            continue;
+        }
+        char ch = s.text[x - s.from];
+        unsigned char *out = hl + x - s.from;
+        bool content = state & LEX_CONTENT;
+        state |= LEX_CONTENT;
+        if (!content && (isdigit((unsigned char)ch) || (ch == '[' && isdigit((unsigned char)s[x + 1])))) {
+            // a timestamp: digits and separators, with single spaces between digits
+            int end = x + 1;
+            while (end < s.to + LEX_PEEK) {
+                char next = s[end];
+                if (isdigit((unsigned char)next) || (next && strchr("-:.,/TZ+", next))) end++;
+                else if (next == ' ' && isdigit((unsigned char)s[end + 1])) end++;
+                else break;
+            }
+            if (ch == '[' && s[end] == ']') end++;
+            int stop = min(end, s.to);
+            memset(out, HL_TIME, stop - x);
+            x = stop;
+        } else if (ch == '"') {
+            *out = HL_STRING;
+            state = lexWith(state, LEX_STRING, HL_STRING);
+            x++;
+        } else if (isWordChar(ch)) {
+            int start = x;
+            x = lexWord(state, s, x, hl, classifyLog);
+            // key=value pairs
+            if ((state & LEX_MODE) == LEX_NORMAL && s[x] == '=' && !isdigit((unsigned char)ch)) {
+                memset(out, HL_KEY, x - start);
+            }
+        } else {
+            *out = HL_NORMAL;
+            x++;
+        }
+    }
+    return state;
+}
+
+// what carries over into the next line: block comments, and block scalars
+static int lexEndOfLine(int state) {
+    int mode = state & LEX_MODE;
+    if (mode == LEX_BLOCK_COMMENT) return LEX_BLOCK_COMMENT;
+    int indent = state & ~((1 << LEX_INDENT_SHIFT) - 1);
+    if (mode == LEX_BLOCK_SCALAR) return LEX_BLOCK_SCALAR | indent;
+    if (state & LEX_BLOCK) return LEX_BLOCK_SCALAR | indent;
+    return LEX_NORMAL;
+}
+
+struct Syntax {
+    const char *name;
+    const char *const *extensions; // also matches a name like app.log.1
+    int (*lex)(int state, const LexText &text, unsigned char *hl);
+};
+
+static const char *const CPP_EXTENSIONS[] = {".c", ".h", ".cc", ".cpp", ".cxx", ".hh", ".hpp", ".hxx", ".inl", nullptr};
+static const char *const JSON_EXTENSIONS[] = {".json", ".jsonl", ".ndjson", ".geojson", nullptr};
+static const char *const YAML_EXTENSIONS[] = {".yaml", ".yml", nullptr};
+static const char *const LOG_EXTENSIONS[] = {".log", nullptr};
+
+static const Syntax SYNTAXES[] = {
+    {"c++", CPP_EXTENSIONS, lexCpp},
+    {"json", JSON_EXTENSIONS, lexJson},
+    {"yaml", YAML_EXTENSIONS, lexYaml},
+    {"log", LOG_EXTENSIONS, lexLog}
+};
+
+// nullptr for plain text
+const Syntax *findSyntax(const char *filename) {
+    if (filename == nullptr) return nullptr;
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    for (size_t i = 0; i < sizeof(SYNTAXES) / sizeof(SYNTAXES[0]); i++) {
+        for (const char *const *ext = SYNTAXES[i].extensions; *ext; ext++) {
+            const char *found = strstr(base, *ext);
+            if (found == nullptr) continue;
+            char after = found[strlen(*ext)];
+            // foo.c, and rotated logs like foo.log.1, but not foo.cfg
+            if (after == '\0' || (after == '.' && SYNTAXES[i].lex == lexLog)) return &SYNTAXES[i];
+        }
+    }
+    return nullptr;
+}
+
+int EditorRow::highlight(const Syntax &syntax, int state) {
+    size_t first = chunks[0].state == state ? lex_from : 0;
+    if (first == chunks.size()) return lex_end;
+    // go on from the state the first chunk to lex started with
+    while (first > 0 && chunks[first].state == LEX_UNKNOWN) first--;
+    if (first > 0) state = chunks[first].state;
+    size_t k = first;
+    while (k < chunks.size()) {
+        RowChunk &chunk = chunks[k];
+        if (k > first && chunk.state == state && chunk.hl.size() == chunk.text.size()) {
+            // past an edit, a chunk that starts the way it did is lexed
+            // already; so is the rest up to the next edit, if any
+            size_t next = k + 1;
+            while (next < chunks.size() && chunks[next].hl.size() == chunks[next].text.size()) next++;
+            if (next == chunks.size()) break;
+            first = k = next - 1;
+            state = chunks[k].state;
+        }
+        chunks[k].state = state;
+        chunks[k].hl.resize(chunks[k].text.size());
+        LexText text = {*this, chunks[k].text.data(), starts[k], starts[k + 1]};
+        state = syntax.lex(state, text, (unsigned char *)&chunks[k].hl[0]);
+        k++;
+    }
+    if (k == chunks.size()) lex_end = lexEndOfLine(state);
+    lex_from = chunks.size();
+    return lex_end;
+}
+
+// how many screen rows every line takes when long lines are wrapped. the
+// lines are grouped in spans of about WRAP_SPAN; a span remembers only the
+// lines that take more than one row, and Fenwick trees over the spans sum
+// up lines and rows, so going from a line to its screen row and back is
+// O(log n). an edited span, or every span after the width changed, keeps
+// its old counts as a guess along with a range of lines to measure again.
+// the spans in view are measured when they are looked at, the rest in the
+// background
+class WrapIndex {
+private:
+    struct Span {
+        int lines;
+        long long extra; // rows past the first one of every line
+        std::vector<std::pair<int, int> > wrapped; // (line in the span, extra rows), in order
+        int dirty_from;  // lines [dirty_from, dirty_to) have to be measured again
+        int dirty_to;
+    };
+
+    const Document &document;
+    const RowCache &rows; // cached rows know their length already
+    std::vector<Span> spans;
+    std::vector<int> tree_lines; // Fenwick trees over the spans, 1-based
+    std::vector<long long> tree_rows;
+    size_t capacity;
+    int lines_total;
+    long long rows_total;
+    size_t next; // where the background measuring goes on
+
+    void add(size_t s, int lines, long long rows) {
+        for (size_t i = s + 1; i <= capacity; i += i & -i) {
+            tree_lines[i] += lines;
+            tree_rows[i] += rows;
+        }
+        lines_total += lines;
+        rows_total += rows;
+    }
+
+    // lines and rows in the spans before span s
+    void before(size_t s, int &lines, long long &rows) const {
+        lines = 0;
+        rows = 0;
+        for (size_t i = s; i > 0; i -= i & -i) {
+            lines += tree_lines[i];
+            rows += tree_rows[i];
+        }
+    }
+
+    // the span that the value-th line (or row) falls in
+    template<class T>
+    size_t descend(const std::vector<T> &tree, T value) const {
+        size_t pos = 0;
+        for (size_t step = capacity; step; step >>= 1) {
+            if (pos + step <= capacity && tree[pos + step] <= value) {
+                pos += step;
+                value -= tree[pos];
+            }
+        }
+        return min(pos, spans.size() - 1);
+    }
+
+    void rebuild() {
+        for (capacity = 1; capacity < spans.size(); capacity <<= 1);
+        tree_lines.assign(capacity + 1, 0);
+        tree_rows.assign(capacity + 1, 0);
+        lines_total = 0;
+        rows_total = 0;
+        for (size_t s = 0; s < spans.size(); s++) add(s, spans[s].lines, spans[s].lines + spans[s].extra);
+    }
+
+    static bool isDirty(const Span &span) {
+        return span.dirty_from < span.dirty_to;
+    }
+
+    static void touch(Span &span, int from, int to) {
+        if (from >= to) return;
+        if (!isDirty(span)) {
+            span.dirty_from = from;
+            span.dirty_to = to;
+        } else {
+            span.dirty_from = min(span.dirty_from, from);
+            span.dirty_to = max(span.dirty_to, to);
+        }
+    }
+
+    // render length of every line in [from, to), passed to f(line, rlength)
+    template<class F>
+    void measureLines(int from, int to, F f) const {
+        RowCache::const_iterator it = rows.lower_bound(from);
+        while (from < to) {
+            if (it != rows.end() && it->first == from) {
+                f(from++, it->second.rlength);
+                ++it;
+                continue;
+            }
+            int stop = it != rows.end() && it->first < to ? it->first : to;
+            int line = from, rx = 0;
+            bool cr = false; // a '\r' that ends a line is not shown
+            std::string rest; // the rest of a line from its first tab or UTF-8 char, which may span pieces
+            document.forEachChunk(document.lineStart(from), document.lineEnd(stop - 1), [&](const char *str, size_t length) {
+                const char *p = str, *end = str + length;
+                while (p < end) {
+                    const char *nl = (const char *)memchr(p, '\n', end - p);
+                    if (nl == nullptr) nl = end;
+                    // plain chars are counted, from the first tab or UTF-8 char on they are measured
+                    const char *special = rest.empty() ? p + findTabOrUtf8(p, nl - p) : p;
+                    rx += special - p;
+                    if (special < nl) rest.append(special, nl - special);
+                    if (nl > p) cr = nl[-1] == '\r';
+                    if (nl == end) break;
+                    if (!rest.empty()) {
+                        rx = RowChunk::advanceText(rest.data(), rest.size(), rx);
+                        rest.clear();
+                    }
+                    f(line++, rx - cr);
+                    rx = 0;
+                    cr = false;
+                    p = nl + 1;
+                }
+            });
+            rx = RowChunk::advanceText(rest.data(), rest.size(), rx);
+            f(line, rx - cr);
+            from = stop;
+        }
+    }
+
+    void measure(size_t s) {
+        Span &span = spans[s];
+        if (!isDirty(span)) return;
+        int first;
+        long long unused;
+        before(s, first, unused);
+        std::vector<std::pair<int, int> > fresh;
+        measureLines(first + span.dirty_from, first + span.dirty_to, [&](int line, int rlength) {
+            int extra = rlength / width;
+            if (extra) fresh.push_back(std::make_pair(line - first, extra));
+        });
+        std::vector<std::pair<int, int> >::iterator lo = std::lower_bound(
+            span.wrapped.begin(), span.wrapped.end(), std::make_pair(span.dirty_from, 0));
+        std::vector<std::pair<int, int> >::iterator hi = std::lower_bound(
+            lo, span.wrapped.end(), std::make_pair(span.dirty_to, 0));
+        long long delta = 0;
+        for (std::vector<std::pair<int, int> >::iterator i = lo; i != hi; ++i) delta -= i->second;
+        for (size_t i = 0; i < fresh.size(); i++) delta += fresh[i].second;
+        lo = span.wrapped.erase(lo, hi);
+        span.wrapped.insert(lo, fresh.begin(), fresh.end());
+        span.extra += delta;
+        span.dirty_from = span.dirty_to = 0;
+        add(s, 0, delta);
+    }
+
+    // a span grown past twice its size is cut into spans of WRAP_SPAN lines
+    void split(size_t s) {
+        Span old = spans[s];
+        std::vector<Span> parts;
+        size_t i = 0;
+        for (int from = 0; from < old.lines; from += WRAP_SPAN) {
+            Span part;
+            part.lines = min(WRAP_SPAN, old.lines - from);
+            part.extra = 0;
+            for (; i < old.wrapped.size() && old.wrapped[i].first < from + part.lines; i++) {
+                part.wrapped.push_back(std::make_pair(old.wrapped[i].first - from, old.wrapped[i].second));
+                part.extra += old.wrapped[i].second;
+            }
+            part.dirty_from = part.dirty_to = 0;
+            if (isDirty(old)) touch(part, max(old.dirty_from - from, 0), min(old.dirty_to - from, part.lines));
+            parts.push_back(part);
+        }
+        spans.erase(spans.begin() + s);
+        spans.insert(spans.begin() + s, parts.begin(), parts.end());
+        rebuild();
+    }
+
+    // `count` new lines that nothing is known about yet go before line `at`
+    void insertLines(int at, int count) {
+        if (count <= 0) return;
+        if (spans.empty()) {
+            Span span = {0, 0, std::vector<std::pair<int, int> >(), 0, 0};
+            spans.push_back(span);
+            rebuild();
+        }
+        size_t s = at >= lines_total ? spans.size() - 1 : descend(tree_lines, at);
+        int first;
+        long long unused;
+        before(s, first, unused);
+        int local = at - first;
+        Span &span = spans[s];
+        for (size_t i = 0; i < span.wrapped.size(); i++) {
+            if (span.wrapped[i].first >= local) span.wrapped[i].first += count;
+        }
+        if (span.dirty_from > local) span.dirty_from += count;
+        if (span.dirty_to > local) span.dirty_to += count;
+        touch(span, local, local + count);
+        span.lines += count;
+        add(s, count, count);
+        if (span.lines > 2 * WRAP_SPAN) split(s);
+    }
+
+    void eraseLines(int at, int count) {
+        count = min(count, lines_total - at);
+        bool emptied = false;
+        while (count > 0) {
+            size_t s = descend(tree_lines, at);
+            int first;
+            long long unused;
+            before(s, first, unused);
+            Span &span = spans[s];
+            int local = at - first, take = min(count, span.lines - local);
+            long long extra = 0;
+            std::vector<std::pair<int, int> >::iterator i = span.wrapped.begin();
+            while (i != span.wrapped.end()) {
+                if (i->first >= local + take) {
+                    i->first -= take;
+                } else if (i->first >= local) {
+                    extra += i->second;
+                    i = span.wrapped.erase(i);
+                    continue;
+                }
+                ++i;
+            }
+            span.dirty_from = span.dirty_from <= local ? span.dirty_from : max(local, span.dirty_from - take);
+            span.dirty_to = span.dirty_to <= local ? span.dirty_to : max(local, span.dirty_to - take);
+            span.lines -= take;
+            span.extra -= extra;
+            add(s, -take, -take - extra);
+            emptied = emptied || span.lines == 0;
+            count -= take;
+        }
+        if (!emptied) return;
+        size_t kept = 0;
+        for (size_t s = 0; s < spans.size(); s++) {
+            if (spans[s].lines > 0) std::swap(spans[kept++], spans[s]);
+        }
+        spans.resize(kept);
+        rebuild();
+    }
+
 public:
-    char str[MAXLEN];
-    int length;
-    char rstr[MAXLEN];
-    int rlength;
+    int width;
 
-    EditorRow(): length(0), rlength(0) {}
-    EditorRow(const char *str, int length) {
-        update(str, length);
+    WrapIndex(const Document &document, const RowCache &rows):
+        document(document), rows(rows), capacity(0), lines_total(0), rows_total(0), next(0), width(1) {
     }
-    void update(const char *str, int length) {
-        this->length = length;
-        memcpy(this->str, str, length);
 
-        render();
-        // this->str[this->length] = '\0';
+    void clear() {
+        spans.clear();
+        rebuild();
     }
 
-    void render() {
-        this->rlength = 0;
-        for (int i = 0; i < length; i++) {
-            if (str[i] == '\t') {
-                for (int t = 0; t < TAB_SPACE_LENGTH; t++) rstr[rlength++] = ' ';
-            } else rstr[rlength++] = str[i];
-        }
+    // memory held by the index
+    size_t bytes() const {
+        size_t total = spans.capacity() * sizeof(Span) + (tree_lines.capacity() + tree_rows.capacity()) * 8;
+        for (size_t s = 0; s < spans.size(); s++) total += spans[s].wrapped.capacity() * sizeof(spans[s].wrapped[0]);
+        return total;
+    }
+
+    // everything is measured again at a new width; the old counts are the
+    // guess until then
+    void rewrap(int new_width) {
+        width = max(new_width, 1);
+        for (size_t s = 0; s < spans.size(); s++) touch(spans[s], 0, spans[s].lines);
     }
 
-    void insertChar(int at, char c) {
-        if (at < 0 || at > length) at = length;
-        memmove(str + at + 1, str + at, length - at + 1);
-        str[at] = c;
-        length++;
-        render();
+    // catch up with a document of `count` lines, like one being indexed
+    void sync(int count) {
+        if (count > lines_total) insertLines(lines_total, count - lines_total);
+        else eraseLines(count, lines_total - count);
     }
 
-    int deleteChar(int at) {
-        if (at < 0) return UP_LINE_FEED;
-        else if (at >= length) return DOWN_LINE_FEED;
-        char ret = str[at];
-        memmove(str + at, str + at + 1, length - at);
-        length--;
-        render();
-        return ret;
+    // lines [line, line + removed] were replaced by [line, line + added]
+    void change(int line, int removed, int added) {
+        sync(max(lines_total, line + removed + 1));
+        eraseLines(line + 1, removed);
+        insertLines(line + 1, added);
+        size_t s = descend(tree_lines, line);
+        int first;
+        long long unused;
+        before(s, first, unused);
+        touch(spans[s], line - first, line - first + 1);
+    }
+
+    // measures the spans that lines [from, to) are in
+    void measure(int from, int to) {
+        from = max(from, 0);
+        to = min(to, lines_total);
+        if (from >= to) return;
+        for (size_t s = descend(tree_lines, from), end = descend(tree_lines, to - 1); s <= end; s++) measure(s);
+    }
+
+    // measures spans in the background for about `budget` ms; false once
+    // everything is measured
+    bool measureSome(int budget) {
+        long long until = editorNow() + budget;
+        for (size_t n = 0; n < spans.size(); n++, next++) {
+            if (next >= spans.size()) next = 0;
+            if (!isDirty(spans[next])) continue;
+            measure(next);
+            if (editorNow() >= until) return true;
+        }
+        return false;
+    }
+
+    bool pending() const {
+        for (size_t s = 0; s < spans.size(); s++) {
+            if (isDirty(spans[s])) return true;
+        }
+        return false;
     }
 
-    void deleteRow() {
-        length = rlength = 0;
+    long long rowCount() const {
+        return rows_total;
     }
 
-    void appendString(char *s, int len) {
-        memcpy(str + length, s, len);
-        length += len;
-        render();
+    // the screen row that line starts on
+    long long rowOf(int line) {
+        if (line >= lines_total) return rows_total;
+        size_t s = descend(tree_lines, line);
+        measure(s);
+        int first;
+        long long row;
+        before(s, first, row);
+        int local = line - first;
+        row += local;
+        const std::vector<std::pair<int, int> > &wrapped = spans[s].wrapped;
+        for (size_t i = 0; i < wrapped.size() && wrapped[i].first < local; i++) row += wrapped[i].second;
+        return row;
     }
 
-    void shrinkString(int len) {
-        if (length < len) return;
-        length -= len;
-        render();
+    // the line that screen row `row` falls on, and which of its rows it is
+    int lineAt(long long row, int &sub) {
+        sub = 0;
+        if (spans.empty()) return 0;
+        row = max(0LL, min(row, rows_total - 1));
+        size_t s = descend(tree_rows, row);
+        while (isDirty(spans[s])) {
+            // measuring changes the rows of this span and no other
+            measure(s);
+            s = descend(tree_rows, row);
+        }
+        int first;
+        long long start;
+        before(s, first, start);
+        long long r = row - start, extra = 0;
+        const std::vector<std::pair<int, int> > &wrapped = spans[s].wrapped;
+        for (size_t i = 0; i < wrapped.size(); i++) {
+            long long at = wrapped[i].first + extra;
+            if (r < at) break;
+            if (r <= at + wrapped[i].second) {
+                sub = r - at;
+                return first + wrapped[i].first;
+            }
+            extra += wrapped[i].second;
+        }
+        return first + r - extra;
     }
 };
 
@@ -128,82 +4131,650 @@ public:
     int terminal_width; // 80
     int text_height; // 23
 
-    int cursor_x; // 0-based
-    int cursor_y; // 0-based
+    int current_x; // 0-based char index in the current row
+    int current_y; // 0-based row
+
+    int cursor_x; // 0-based, on screen
+    int cursor_y; // 0-based, on screen
 
-    int offset_x; // 0-based
+    int offset_x; // 0-based, in render columns
     int offset_y; // 0-based
+    int offset_row; // screen rows of line offset_y above the view, when wrapping
 
-    EditorRow *editor_rows;
+    Document document;
+    RowCache rows; // rows materialized around the viewport
+    EditorRow empty_row; // stands in for rows past the end
     int n_rows;
+    bool soft_wrap; // long lines go on in the next screen row instead of scrolling sideways
+    WrapIndex wrap; // kept only while soft_wrap is on
+    const Syntax *syntax; // nullptr for plain text
+    std::vector<int> syntax_states; // lexer state at the end of every line lexed so far
 
     char *filename;
-    char status_message[100];
+    char status_message[200];
     int status_message_length;
     time_t status_message_time;
 
     bool dirty; // true when modified but not saved yet
+    size_t mark; // where the selection started, std::string::npos without one
+    Document clipboard; // shares its pieces with the text it was copied from
+    bool osc52; // copies go to the system clipboard too, through the terminal
+    UndoLog undo;
+    Journal journal;
+    SaveWorker *save_worker; // writing the file in the background, if anything
+    TextBlock *base; // the mapped file while it is what is on disk, in state base_st
+    struct stat base_st;
+    FileFollower follow;
+    StreamLoader *loader; // a pipe still being read, if anything
+    size_t file_size; // bytes of the file that the buffer holds
 
-    EditorConfig() {
+    std::string search_query; // highlighted while not empty
+    SearchPattern search_pattern;
+    bool search_regex;
+    long long search_count;   // number of matches, -1 when it has to be counted again
+    long long search_index;   // 1-based number of the match at search_match
+    size_t search_match;
+    SearchWorker *search_worker; // counting matches in the background, if anything
+
+    bool show_counts; // words and bytes next to the line count
+    bool redraw; // something changed since the last frame
+    int max_fps;
+    long long last_frame;
+
+    EditorConfig(): wrap(document, rows) {
+        soft_wrap = false;
+        syntax = nullptr;
         filename = nullptr;
         status_message[0] = '\0';
         status_message_length = 0;
         status_message_time = 0;
         dirty = false;
+        mark = std::string::npos;
+        osc52 = false;
+        save_worker = nullptr;
+        base = nullptr;
+        file_size = 0;
+        loader = nullptr;
+        search_count = -1;
+        search_regex = false;
+        search_match = std::string::npos;
+        search_worker = nullptr;
+        show_counts = false;
+        redraw = true;
+        max_fps = DEFAULT_MAX_FPS;
+        last_frame = 0;
     }
 
     // 0-based
     int getCurrentY() const {
-        return cursor_y + offset_y;
+        return current_y;
     }
     
     // 0-based
     int getCurrentX() const {
-        return cursor_x + offset_x;
+        return current_x;
+    }
+
+    EditorRow *getRow(int y) {
+        if (y >= n_rows) {
+            empty_row = EditorRow();
+            empty_row.offset = document.size();
+            return &empty_row;
+        }
+        RowCache::iterator it = rows.find(y);
+        if (it == rows.end()) {
+            it = rows.insert(std::make_pair(y, EditorRow())).first;
+            it->second.load(document, y);
+        }
+        return &it->second;
     }
 
     EditorRow *getCurrentRow() {
-        return editor_rows + getCurrentY();
+        return getRow(getCurrentY());
     }
 
     int getMaxLength() {
-        return getCurrentRow()->rlength;
+        return getCurrentRow()->length;
     }
 };
 
+void die(const char *str);
+
+// everything a frame wants to say is collected here and handed to the
+// terminal in one go. the memory is kept and reused by the next frame
 class WriteBuffer {
 private:
-    char buf[MAXBUF];
-    int length;
+    char *buf;
+    size_t length;
+    size_t capacity;
 public:
-    WriteBuffer(): length(0) {
+    size_t syscalls;      // write(2) calls so far
+    size_t last_syscalls; // write(2) calls of the last flush
+
+    WriteBuffer(): buf(nullptr), length(0), capacity(0), syscalls(0), last_syscalls(0) {
+    }
+
+    ~WriteBuffer() {
+        free(buf);
     }
 
-    WriteBuffer(const char *str, int length): length(0) {
-        update(str, length);
+    void reserve(size_t size) {
+        if (size <= capacity) return;
+        capacity = max(max(size, capacity * 2), (size_t)MAXBUF);
+        buf = (char *)realloc(buf, capacity);
+        if (buf == nullptr) die("realloc");
     }
 
-    void update(const char *str, int length) {
+    void append(const char *str, int length) {
+        reserve(this->length + length);
         memcpy(buf + this->length, str, length);
         this->length += length;
     }
 
-    void append(const char *str, int length) {
-        if (this->length + length > MAXBUF) {
-            writeBuffer();
-            this->length = 0;
+    // writes the whole buffer, coping with short writes and with a
+    // non-blocking stdout that is full for the moment
+    void writeBuffer() {
+        size_t done = 0;
+        last_syscalls = 0;
+        while (done < length) {
+            ssize_t nwritten = write(STDOUT_FILENO, buf + done, length - done);
+            syscalls++;
+            last_syscalls++;
+            if (nwritten > 0) {
+                done += nwritten;
+            } else if (nwritten == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                pollfd pfd = {STDOUT_FILENO, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+            } else if (nwritten == -1 && errno != EINTR) {
+                break; // the terminal is gone, nothing left to draw on
+            }
         }
-        update(str, length);
-        // memcpy(this->buf + this->length, str, length);
-        // this->length += length;
+        length = 0;
     }
+};
 
-    void writeBuffer() {
-        // buf[length] = '\0';
-        write(STDOUT_FILENO, buf, length);
-#ifdef DEBUG
-        memset(buf, 0, sizeof(buf));
-#endif
+enum cell_attrs {
+    ATTR_NONE = 0,
+    ATTR_REVERSE = 1,
+    ATTR_MATCH = 2, // a search match
+    ATTR_COLOR_SHIFT = 4 // the highlight class of the text is in the high bits
+};
+
+// what one terminal cell shows: a UTF-8 char and the combining marks on top
+// of it. a wide char takes two cells, and the second one is left empty. the
+// bytes past `length` are kept zero so cells compare as plain memory
+struct Cell {
+    char text[6];
+    unsigned char length; // 0 in the right half of a wide char
+    unsigned char attr;
+
+    bool operator==(const Cell &other) const {
+        uint64_t bits, other_bits;
+        memcpy(&bits, this, sizeof(bits));
+        memcpy(&other_bits, &other, sizeof(other_bits));
+        return bits == other_bits;
+    }
+    bool operator!=(const Cell &other) const {
+        return !(*this == other);
+    }
+};
+
+// frames are drawn into a grid of cells first. the grid remembers what the
+// terminal is showing, so flush() only sends the cells that changed
+class ScreenGrid {
+private:
+    int width;
+    int height;
+    std::vector<Cell> cells;    // the frame being drawn
+    std::vector<Cell> previous; // the frame on the terminal
+    bool valid;                 // false when the terminal has to be repainted
+
+    // where the terminal cursor is and which attributes are active while flushing
+    int cursor_x;
+    int cursor_y;
+    unsigned char attr;
+    bool hidden;
+    size_t bytes;
+    int last_x; // where the cursor was parked after the last frame
+    int last_y;
+
+    // rows [scroll_top, scroll_bottom) move up by scroll_delta rows this frame
+    int scroll_top;
+    int scroll_bottom;
+    int scroll_delta;
+
+    static Cell blank() {
+        Cell cell = {{' '}, 1, ATTR_NONE};
+        return cell;
+    }
+
+    void emit(WriteBuffer &out, const char *str, int length) {
+        out.append(str, length);
+        bytes += length;
+    }
+
+    void setAttr(WriteBuffer &out, unsigned char to) {
+        // foreground color of every highlight class
+        static const char *const colors[HL_COUNT] = {
+            "", ";36", ";33", ";32", ";35", ";31", ";34", ";36", ";93", ";91"
+        };
+        if (to == attr) return;
+        char temp[24] = "\033[0";
+        strcat(temp, colors[(to >> ATTR_COLOR_SHIFT) % HL_COUNT]);
+        if (to & ATTR_REVERSE) strcat(temp, ";7");
+        if (to & ATTR_MATCH) strcat(temp, ";30;43"); // black on yellow
+        strcat(temp, "m");
+        emit(out, temp, strlen(temp));
+        attr = to;
+    }
+
+    void moveTo(WriteBuffer &out, int x, int y) {
+        if (cursor_y == y && cursor_x == x) return;
+        char temp[30];
+        int temp_length = snprintf(temp, sizeof(temp), "\033[%d;%dH", y + 1, x + 1);
+        // on the same row, reprinting a few unchanged cells is cheaper than a jump
+        if (cursor_y == y && cursor_x >= 0 && cursor_x < x && x - cursor_x <= temp_length) {
+            const Cell *row = &cells[y * width];
+            bool same_attr = true;
+            for (int i = cursor_x; i < x; i++) same_attr = same_attr && row[i].attr == attr;
+            if (same_attr) {
+                for (int i = cursor_x; i < x; i++) emit(out, row[i].text, row[i].length);
+                cursor_x = x;
+                return;
+            }
+        }
+        emit(out, temp, temp_length);
+        cursor_x = x;
+        cursor_y = y;
+    }
+
+    // the cursor is hidden while a frame is being painted
+    void hideCursor(WriteBuffer &out) {
+        if (hidden) return;
+        emit(out, "\033[?25l", 6);
+        hidden = true;
+    }
+
+    // let the terminal move the rows with a scroll region (DECSTBM) and
+    // shift our copy of the old frame the same way, so that only the rows
+    // scrolled into view are left to draw
+    void emitScroll(WriteBuffer &out) {
+        int count = abs(scroll_delta);
+        char temp[40];
+        int temp_length = snprintf(
+            temp, sizeof(temp), "\033[%d;%dr\033[%d%c\033[r",
+            scroll_top + 1, scroll_bottom, count, scroll_delta > 0 ? 'S' : 'T'
+        );
+        hideCursor(out);
+        emit(out, temp, temp_length);
+        cursor_x = cursor_y = -1;
+
+        std::vector<Cell>::iterator top = previous.begin() + scroll_top * width;
+        std::vector<Cell>::iterator bottom = previous.begin() + scroll_bottom * width;
+        if (scroll_delta > 0) {
+            std::copy(top + count * width, bottom, top);
+            std::fill(bottom - count * width, bottom, blank());
+        } else {
+            std::copy_backward(top, bottom - count * width, bottom);
+            std::fill(top, top + count * width, blank());
+        }
+        scroll_delta = 0;
+    }
+
+    void putCell(WriteBuffer &out, int x, int y) {
+        const Cell &cell = cells[y * width + x];
+        if (cell.length == 0) return; // drawn along with the left half
+        int columns = x + 1 < width && cells[y * width + x + 1].length == 0 ? 2 : 1;
+        hideCursor(out);
+        moveTo(out, x, y);
+        setAttr(out, cell.attr);
+        emit(out, cell.text, cell.length);
+        // writing the last column leaves the cursor in limbo, so forget where it is
+        cursor_x = x + columns < width ? x + columns : -1;
+    }
+
+public:
+    // statistics about what we sent to the terminal
+    size_t frames;
+    size_t last_frame_bytes;
+    size_t total_bytes;
+
+    ScreenGrid():
+        width(0), height(0), valid(false), last_x(-1), last_y(-1), scroll_delta(0),
+        frames(0), last_frame_bytes(0), total_bytes(0) {}
+
+    void resize(int width, int height) {
+        if (width == this->width && height == this->height) return;
+        this->width = width;
+        this->height = height;
+        cells.assign(width * height, blank());
+        previous.assign(width * height, blank());
+        valid = false;
+    }
+
+    void invalidate() {
+        valid = false;
+    }
+
+    void clear() {
+        cells.assign(width * height, blank());
+    }
+
+    // the content of rows [top, bottom) moved up by `delta` rows (down if
+    // negative) since the last frame
+    void scroll(int top, int bottom, int delta) {
+        if (scroll_delta != 0 && (top != scroll_top || bottom != scroll_bottom)) return;
+        scroll_top = top;
+        scroll_bottom = bottom;
+        scroll_delta += delta;
+    }
+
+    // draws the UTF-8 text str at (x, y), clipped to the row
+    void put(int x, int y, const char *str, int length, unsigned char attr = ATTR_NONE) {
+        if (y < 0 || y >= height) return;
+        Cell *row = &cells[y * width];
+        int start = x;
+        for (int i = 0, size; i < length && x < width; i += size) {
+            int codepoint = (unsigned char)str[i];
+            size = codepoint < 0x80 ? 1 : utf8Decode(str + i, length - i, &codepoint);
+            int columns = charWidth(codepoint);
+            if (columns == 0) {
+                // a combining mark joins the char drawn before it, if there is room
+                Cell *base = x - 1 >= max(start, 0) ? &row[x - 1] : nullptr;
+                if (base && base->length == 0) base = x - 2 >= max(start, 0) ? &row[x - 2] : nullptr;
+                if (base && base->length + size <= (int)sizeof(base->text)) {
+                    memcpy(base->text + base->length, str + i, size);
+                    base->length += size;
+                }
+                continue;
+            }
+            if (x >= 0) {
+                // never leave half of a wide char that was drawn here before
+                if (row[x].length == 0 && x > 0) row[x - 1] = blank();
+                if (x + 1 < width && row[x + 1].length == 0) row[x + 1] = blank();
+                Cell cell = {{'?'}, 1, attr}; // stray bytes and control chars
+                if (x + columns > width) {
+                    cell.text[0] = ' '; // half of a wide char does not fit
+                } else if (codepoint >= 0xa0 || (codepoint >= ' ' && codepoint < 0x7f)) {
+                    memcpy(cell.text, str + i, size);
+                    cell.length = size;
+                }
+                row[x] = cell;
+                if (columns == 2 && x + 1 < width) {
+                    Cell half = {{0}, 0, attr};
+                    row[x + 1] = half;
+                }
+            }
+            x += columns;
+        }
+    }
+
+    // colors cells by the highlight classes of what they show
+    void color(int x, int y, const char *classes, int length) {
+        if (y < 0 || y >= height) return;
+        Cell *row = &cells[y * width];
+        for (int i = 0; i < length && x + i < width; i++) {
+            if (x + i >= 0) row[x + i].attr = classes[i] << ATTR_COLOR_SHIFT;
+        }
+    }
+
+    // changes the attributes of cells without touching what they show
+    void highlight(int x, int y, int length, unsigned char attr) {
+        if (y < 0 || y >= height) return;
+        Cell *row = &cells[y * width];
+        for (int i = max(0, x); i < x + length && i < width; i++) row[i].attr = attr;
+    }
+
+    void fill(int x, int y, int length, char ch, unsigned char attr = ATTR_NONE) {
+        if (y < 0 || y >= height) return;
+        Cell *row = &cells[y * width];
+        Cell cell = {{ch}, 1, attr};
+        for (int i = max(0, x); i < x + length && i < width; i++) row[i] = cell;
+    }
+
+    // sends the difference between the last frame and this one, then parks
+    // the cursor at (x, y). an unchanged frame costs nothing at all
+    void flush(WriteBuffer &out, int x, int y) {
+        bytes = 0;
+        attr = ATTR_NONE;
+        hidden = false;
+        cursor_x = cursor_y = -1;
+        if (!valid) {
+            hideCursor(out);
+            emit(out, "\033[m\033[2J", 7);
+            previous.assign(width * height, blank());
+            scroll_delta = 0;
+        } else if (scroll_delta != 0) {
+            if (abs(scroll_delta) < scroll_bottom - scroll_top) emitScroll(out);
+            scroll_delta = 0;
+        }
+        for (int dy = 0; dy < height; dy++) {
+            const Cell *now = &cells[dy * width];
+            const Cell *old = &previous[dy * width];
+            int end = width, old_end = width;
+            while (end > 0 && now[end - 1] == blank()) end--;
+            while (old_end > 0 && old[old_end - 1] == blank()) old_end--;
+            for (int dx = 0; dx < end; dx++) {
+                if (now[dx] != old[dx]) putCell(out, dx, dy);
+            }
+            if (old_end > end) {
+                hideCursor(out);
+                moveTo(out, end, dy);
+                setAttr(out, ATTR_NONE);
+                emit(out, "\033[K", 3); // erase from cursor to end of line
+            }
+        }
+        setAttr(out, ATTR_NONE);
+        if (hidden || x != last_x || y != last_y) {
+            cursor_x = cursor_y = -1;
+            moveTo(out, x, y);
+        }
+        if (hidden) emit(out, "\033[?25h", 6);
+        previous.swap(cells);
+        valid = true;
+        last_x = x;
+        last_y = y;
+        frames++;
+        last_frame_bytes = bytes;
+        total_bytes += bytes;
+        out.writeBuffer();
+    }
+};
+
+// stdin is read in big chunks and keys are decoded out of the buffer, so a
+// burst of input costs a handful of reads instead of one per byte
+class InputReader {
+private:
+    char buf[INPUT_BUFFER];
+    size_t start;
+    size_t end;
+
+    // byte i of the pending input, or -1 if it does not arrive in time
+    int peek(size_t i) {
+        if (start + i >= end) fill(ESCAPE_TIMEOUT);
+        if (start + i >= end) return -1;
+        return (unsigned char)buf[start + i];
+    }
+
+    // collects everything up to the end of a bracketed paste
+    void readPaste() {
+        paste.clear();
+        int idle = 0;
+        while (1) {
+            const char *marker = (const char *)memmem(buf + start, end - start, "\033[201~", 6);
+            if (marker != nullptr) {
+                paste.append(buf + start, marker - (buf + start));
+                start = marker - buf + 6;
+                return;
+            }
+            // hold back what could be the beginning of the end marker
+            size_t keep = min(end - start, (size_t)5);
+            paste.append(buf + start, end - start - keep);
+            start = end - keep;
+            if (fill(ESCAPE_TIMEOUT) > 0) {
+                idle = 0;
+            } else if (++idle == PASTE_TIMEOUT_READS) {
+                paste.append(buf + start, end - start);
+                start = end;
+                return;
+            }
+        }
+    }
+
+public:
+    std::string paste; // text of the last PASTE key
+    size_t reads;
+
+    InputReader(): start(0), end(0), reads(0) {}
+
+    // reads whatever has arrived, waiting up to timeout ms for something to
+    ssize_t fill(int timeout) {
+        pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, timeout) <= 0) return 0;
+        if (start == end) {
+            start = end = 0;
+        } else if (end == INPUT_BUFFER) {
+            memmove(buf, buf + start, end - start);
+            end -= start;
+            start = 0;
+        }
+        if (end == INPUT_BUFFER) return 0;
+        ssize_t nread = read(STDIN_FILENO, buf + end, INPUT_BUFFER - end);
+        reads++;
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+        if (nread > 0) end += nread;
+        return nread;
+    }
+
+    bool buffered() const {
+        return start < end;
+    }
+
+    // the key an escape sequence that ends in ch stands for, or 0
+    static int cursorKey(int ch) {
+        switch (ch) {
+            case 'A': return CURSOR_UP;
+            case 'B': return CURSOR_DOWN;
+            case 'C': return CURSOR_RIGHT;
+            case 'D': return CURSOR_LEFT;
+            case 'H': return HOME;
+            case 'F': return END;
+        }
+        return 0;
+    }
+
+    // decodes the next key; there must be buffered input
+    int decode() {
+        int ch = (unsigned char)buf[start];
+        if (ch != '\033') {
+            start++;
+            return ch;
+        }
+        int ch1 = peek(1);
+        int ch2 = peek(2);
+        if (ch1 == -1 || ch2 == -1) {
+            start = min(start + 3, end);
+            return '\033';
+        }
+        if (ch1 == '[') {
+            if (ch2 >= '0' && ch2 <= '9') {
+                if (ch2 == '2' && peek(3) == '0' && peek(4) == '0' && peek(5) == '~') {
+                    start += 6;
+                    readPaste();
+                    return PASTE;
+                }
+                int ch3 = peek(3);
+                int shift = 0;
+                if (ch3 == ';') {
+                    // with modifiers: ESC [ 1 ; m A or ESC [ 5 ; m ~, where m is 2 for shift
+                    shift = peek(4) == '2' ? SHIFT : 0;
+                    ch3 = peek(5);
+                    start = min(start + 6, end);
+                    if (ch2 == '1' && cursorKey(ch3)) return cursorKey(ch3) | shift;
+                } else {
+                    start = min(start + 4, end);
+                }
+                if (ch3 == '~') {
+                    switch (ch2) {
+                        case '1':
+                        case '7':
+                            return HOME | shift;
+                        case '4':
+                        case '8':
+                            return END | shift;
+                        case '5': return PAGE_UP | shift;
+                        case '6': return PAGE_DOWN | shift;
+                        case '3': return DELETE;
+                    }
+                }
+            } else {
+                start += 3;
+                if (cursorKey(ch2)) return cursorKey(ch2);
+            }
+        } else if (ch1 == 'O') {
+            start += 3;
+            switch (ch2) {
+                case 'H': return HOME;
+                case 'F': return END;
+            }
+        } else {
+            start += 3;
+        }
+        return '\033';
+    }
+};
+
+long long editorNow() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// the things the editor waits on besides keys: a self-pipe that the SIGWINCH
+// handler and background threads write to, and a few one-shot timers
+class EventLoop {
+public:
+    int wake_pipe[2];
+    std::atomic<bool> resized;
+    long long timers[TIMER_COUNT]; // when each timer fires, 0 if it is off
+
+    EventLoop(): resized(false) {
+        wake_pipe[0] = wake_pipe[1] = -1;
+        for (int i = 0; i < TIMER_COUNT; i++) timers[i] = 0;
+    }
+
+    void init() {
+        if (pipe(wake_pipe) == -1) die("pipe");
+        for (int i = 0; i < 2; i++) {
+            fcntl(wake_pipe[i], F_SETFL, O_NONBLOCK);
+            fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    // async-signal-safe; a full pipe already means a wakeup is pending
+    void wake() {
+        if (wake_pipe[1] == -1) return;
+        char ch = 0;
+        ssize_t ret = write(wake_pipe[1], &ch, 1);
+        (void)ret;
+    }
+
+    void drain() {
+        char buf[64];
+        while (read(wake_pipe[0], buf, sizeof(buf)) > 0);
+    }
+
+    void setTimer(int timer, int delay) {
+        timers[timer] = editorNow() + delay;
+    }
+
+    // the earliest timer, or 0 if none is set
+    long long nextTimer() const {
+        long long next = 0;
+        for (int i = 0; i < TIMER_COUNT; i++) {
+            if (timers[i] && (next == 0 || timers[i] < next)) next = timers[i];
+        }
+        return next;
     }
 };
 
@@ -211,12 +4782,32 @@ EditorConfig config;
 
 WriteBuffer write_buffer;
 
+ScreenGrid screen;
+
+InputReader input;
+
+EventLoop events;
+
+void editorWake() {
+    events.wake();
+}
+
+void handleSigwinch(int) {
+    int saved_errno = errno;
+    events.resized = true;
+    events.wake();
+    errno = saved_errno;
+}
+
 void die(const char *str) {
     perror(str);
+    // whatever the journal has is our best bet for getting the edits back
+    config.journal.flush();
     exit(1);
 }
 
 void disableRawMode() {
+    write(STDOUT_FILENO, "\033[?2004l", 8);
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &config.original_termios) == -1)
         die("tcsetattr");
 }
@@ -243,11 +4834,15 @@ void enableRawMode() {
     // IEXTEN: disable ctrl+v (seemingly no need)
     raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
 
+    // reads never block, the event loop polls for input instead
     raw.c_cc[VMIN] = 0; // minimal bytes of input
-    raw.c_cc[VTIME] = 1; // input time: 1/10 sec = 100ms
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         die("tcsetattr");
+
+    // bracketed paste: pasted text arrives wrapped in \033[200~ ... \033[201~
+    write(STDOUT_FILENO, "\033[?2004h", 8);
 }
 
 void printAsOutput(char ch) {
@@ -255,20 +4850,113 @@ void printAsOutput(char ch) {
     else printf("%d ('%c')\r\n", ch, ch);
 }
 
+// big files are indexed lazily: find out about the first `count` rows
+void editorEnsureRows(int count) {
+    if (config.document.lineCountExact()) return;
+    config.document.ensureLines(count);
+    config.n_rows = config.document.lineCount();
+}
+
+// marks the matches of the current search on a visible row, which shows
+// render columns from `column` on
+void editorHighlightMatches(EditorRow *row, int dy, int column) {
+    const SearchPattern &pattern = config.search_pattern;
+    static std::string text;
+    // only what is on screen, and a margin for matches that reach into it
+    int begin = max(0, row->renderToChar(column) - HIGHLIGHT_MARGIN);
+    int end = min(row->length, row->renderToChar(column + config.terminal_width) + HIGHLIGHT_MARGIN);
+    row->read(begin, end, text);
+    SearchMatch m;
+    size_t i = 0;
+    while (pattern.find(text.data(), text.size(), i, m, begin == 0)) {
+        int from = row->charToRender(begin + m.groups[0].rm_so) - column;
+        int to = row->charToRender(begin + m.groups[0].rm_eo) - column;
+        bool current = row->offset + begin + m.groups[0].rm_so == config.search_match;
+        screen.highlight(from, dy, to - from, current ? ATTR_REVERSE : ATTR_MATCH);
+        i = m.groups[0].rm_eo;
+    }
+}
+
+// the selected bytes [from, to) between the mark and the cursor; false
+// when nothing is selected
+bool editorSelection(size_t &from, size_t &to) {
+    if (config.mark == std::string::npos) return false;
+    EditorRow *row = config.getCurrentRow();
+    size_t cursor = row->offset + min(config.current_x, row->length);
+    from = min(config.mark, cursor);
+    to = min(max(config.mark, cursor), config.document.size());
+    return from < to;
+}
+
+// the selected part of a screen row is shown reversed, and a selected
+// line break as one more cell past the end of the line
+void editorHighlightSelection(EditorRow *row, int dy, int column) {
+    size_t from, to;
+    size_t end = row->offset + row->length;
+    if (!editorSelection(from, to) || to <= row->offset || from > end) return;
+    int rx_from = row->charToRender(max(from, row->offset) - row->offset) - column;
+    int rx_to = row->charToRender(min(to, end) - row->offset) - column + (to > end);
+    screen.highlight(rx_from, dy, rx_to - rx_from, ATTR_REVERSE);
+}
+
+// the lexer state row y starts in. lines above it that were never lexed,
+// or that were lexed before the lines above them changed, are lexed first,
+// but no further back than SYNTAX_LOOKBACK lines; beyond that the state is
+// a guess. far-off lines are never lexed
+int editorSyntaxStateBefore(int y) {
+    std::vector<int> &states = config.syntax_states;
+    if (y == 0) return LEX_NORMAL;
+    if ((int)states.size() < y) states.resize(y, LEX_UNKNOWN);
+    int low = max(0, y - SYNTAX_LOOKBACK);
+    int stale = y - 1;
+    while (stale >= low && states[stale] != LEX_UNKNOWN && !(states[stale] & LEX_STALE)) stale--;
+    if (stale < low) return states[y - 1];
+    int from = stale;
+    while (from > low && (states[from - 1] == LEX_UNKNOWN || states[from - 1] & LEX_STALE)) from--;
+    int state = from > 0 && states[from - 1] != LEX_UNKNOWN ? states[from - 1] & ~LEX_STALE : LEX_NORMAL;
+    for (int line = from; line < y; line++) {
+        int end = config.getRow(line)->highlight(*config.syntax, state);
+        // the lines below it were lexed from this very state
+        bool settled = line > stale && states[line] == end;
+        states[line] = end;
+        state = end;
+        if (settled) return states[y - 1];
+    }
+    return state;
+}
+
+// lexes row y where it changed, and keeps the state it ends in for the row
+// below. when that state is new, the row below is lexed again next time
+void editorHighlightRow(int y, EditorRow *row) {
+    std::vector<int> &states = config.syntax_states;
+    int end = row->highlight(*config.syntax, editorSyntaxStateBefore(y));
+    if ((int)states.size() <= y) states.resize(y + 1, LEX_UNKNOWN);
+    bool changed = (states[y] & ~LEX_STALE) != end;
+    states[y] = end;
+    if (changed && y + 1 < (int)states.size() && states[y + 1] != LEX_UNKNOWN) states[y + 1] |= LEX_STALE;
+}
+
 void editorDrawRows() {
+    static std::string text, classes;
+    editorEnsureRows(config.offset_y + config.text_height + 1);
+    int i = config.offset_y;
+    int column = config.soft_wrap ? config.offset_row * config.terminal_width : config.offset_x;
     for (int dy = 0; dy < config.text_height; dy++) {
-        int i = dy + config.offset_y;
         if (i < config.n_rows) {
-            // size_t row_length = min(config.terminal_width, config.editor_rows[i].length);
-            // write_buffer.append(config.editor_rows[i].str, row_length);
-
             // negative number may occur here, so int must be used
-            int row_length = min(config.terminal_width, max(0, config.editor_rows[i].rlength - config.offset_x));
-            write_buffer.append(config.editor_rows[i].rstr + config.offset_x, row_length);
-            if (row_length < config.terminal_width)
-                write_buffer.append("\033[K", 3); // erase from cursor to end of line
+            EditorRow *row = config.getRow(i);
+            if (config.syntax) editorHighlightRow(i, row);
+            row->render(column, config.terminal_width, text, config.syntax ? &classes : nullptr);
+            screen.put(0, dy, text.data(), text.size());
+            if (config.syntax) screen.color(0, dy, classes.data(), classes.size());
+            editorHighlightMatches(row, dy, column);
+            editorHighlightSelection(row, dy, column);
+            // a wrapped line goes on in the next screen row
+            if (config.soft_wrap && (column += config.terminal_width) <= row->rlength) continue;
+            column = config.soft_wrap ? 0 : config.offset_x;
+            i++;
         } else {
-            if (config.n_rows == 0 && i == config.text_height / 3) {
+            if (config.n_rows == 0 && dy == config.text_height / 3) {
                 char welcome[60];
                 int welcome_length = snprintf(
                     welcome, sizeof(welcome),
@@ -276,417 +4964,1102 @@ void editorDrawRows() {
                 );
                 welcome_length = min(welcome_length, config.terminal_width);
                 int padding = (config.terminal_width - welcome_length) / 2;
-                if (padding >= 1) {
-                    write_buffer.append("~", 1);
-                    padding--;
-                }
-                while (padding--) write_buffer.append(" ", 1);
-                // write_buffer.append("Welcome!", 8);
-                write_buffer.append(welcome, welcome_length);
+                screen.put(0, dy, "~", 1);
+                screen.put(max(padding, 1), dy, welcome, welcome_length);
             } else {
-                write_buffer.append("~", 1);
+                screen.put(0, dy, "~", 1);
             }
-            write_buffer.append("\033[K", 3);
-        }
-        // write(STDOUT_FILENO, "~", 1);
-        if (dy != config.text_height - 1) {
-            write_buffer.append("\r\n", 2);
-            // write(STDOUT_FILENO, "\r\n", 2);
         }
-#ifdef DEBUG
-        write_buffer.writeBuffer();
-#endif
     }
 }
 
 void editorDrawStatusBar() {
-    write_buffer.append("\r\n", 2);
-    write_buffer.append("\033[7m", 4);
+    int y = config.text_height;
+    screen.fill(0, y, config.terminal_width, ' ', ATTR_REVERSE);
     char status[80];
-    int status_length = snprintf(
-        status, sizeof(status),
-        "%.20s - %d lines %s",
-        config.filename != nullptr ? config.filename : "[No Name]", config.n_rows,
-        config.dirty ? "(modified)" : ""
-    );
+    int status_length;
+    int progress = config.document.indexProgress();
+    if (config.loader) {
+        status_length = snprintf(
+            status, sizeof(status),
+            "%.20s - %d lines, %zu bytes received, %.1fMB/s %s",
+            config.loader->name.c_str(), config.n_rows, (size_t)config.loader->received,
+            config.loader->throughput() / (1 << 20), config.dirty ? "(modified)" : ""
+        );
+    } else if (progress >= 0) {
+        status_length = snprintf(
+            status, sizeof(status),
+            "%.20s - indexing... %d%% %s",
+            config.filename != nullptr ? config.filename : "[No Name]", progress,
+            config.dirty ? "(modified)" : ""
+        );
+    } else if (config.show_counts) {
+        // all three are kept up to date by the piece tree, nothing is rescanned
+        char words[24] = "?";
+        size_t word_count = config.document.wordCount();
+        if (word_count != std::string::npos) snprintf(words, sizeof(words), "%zu", word_count);
+        status_length = snprintf(
+            status, sizeof(status),
+            "%.20s - %d%s lines, %s words, %zu bytes %s",
+            config.filename != nullptr ? config.filename : "[No Name]", config.n_rows,
+            config.document.lineCountExact() ? "" : "+", words, config.document.size(),
+            config.dirty ? "(modified)" : ""
+        );
+    } else {
+        status_length = snprintf(
+            status, sizeof(status),
+            "%.20s - %d%s lines %s",
+            config.filename != nullptr ? config.filename : "[No Name]", config.n_rows,
+            config.document.lineCountExact() ? "" : "+",
+            config.dirty ? "(modified)" : ""
+        );
+    }
     status_length = min(status_length, config.terminal_width);
-    write_buffer.append(status, status_length);
+    screen.put(0, y, status, status_length, ATTR_REVERSE);
+
+    char search_status[40] = "";
+    if (config.save_worker) {
+        snprintf(search_status, sizeof(search_status), "saving %d%%  ", config.save_worker->progress());
+    } else if (config.search_pattern.errorMessage()) {
+        snprintf(search_status, sizeof(search_status), "bad regex  ");
+    } else if (config.search_worker) {
+        snprintf(search_status, sizeof(search_status), "searching %d%%  ", config.search_worker->progress());
+    } else if (!config.search_query.empty() && config.search_count == 0) {
+        snprintf(search_status, sizeof(search_status), "no match  ");
+    } else if (!config.search_query.empty() && config.search_count > 0) {
+        snprintf(search_status, sizeof(search_status), "match %lld/%lld  ",
+                 config.search_index, config.search_count);
+    }
+    size_t offset = config.getCurrentRow()->offset + config.current_x;
+    size_t size = config.document.size();
+    char current_status[80];
+    int current_status_length = snprintf(
+        current_status, sizeof(current_status),
+        "%s%d, %d  @%zu %d%%", search_status, config.getCurrentY(), config.getCurrentX(),
+        offset, size ? (int)(offset * 100 / size) : 100
+    );
+    if (current_status_length + status_length < config.terminal_width) {
+        screen.put(config.terminal_width - current_status_length, y,
+                   current_status, current_status_length, ATTR_REVERSE);
+    }
+}
+
+void editorSetStatusMessage(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    config.status_message_length = vsnprintf(
+        config.status_message, sizeof(config.status_message), fmt, ap
+    );
+    config.status_message_length = min(config.terminal_width, config.status_message_length);
+    va_end(ap);
+    config.status_message_time = time(NULL);
+    events.setTimer(TIMER_MESSAGE, MESSAGE_TIMEOUT);
+}
+
+void editorDrawMessageBar() {
+    if (config.status_message_length && time(NULL) - config.status_message_time < MESSAGE_TIMEOUT / 1000) {
+        screen.put(0, config.text_height + 1, config.status_message, config.status_message_length);
+    }
+}
+
+// the wrap index measures what it has not seen yet a little at a time
+void editorWrapLater() {
+    if (config.soft_wrap && events.timers[TIMER_WRAP] == 0 && config.wrap.pending()) {
+        events.setTimer(TIMER_WRAP, 0);
+    }
+}
+
+// the screen row at the top of the view while wrapping
+long long editorTopRow() {
+    return config.wrap.rowOf(config.offset_y) + config.offset_row;
+}
+
+// with soft wrap the view scrolls by screen rows. every line takes at least
+// one row, so the text_height lines above the cursor and below the top of
+// the view are all that has to be measured to compare the two
+void editorScrollWrapped(int rx) {
+    WrapIndex &wrap = config.wrap;
+    int width = config.terminal_width;
+    wrap.sync(config.n_rows);
+    wrap.measure(config.current_y - config.text_height, config.current_y + 1);
+    wrap.measure(config.offset_y, config.offset_y + config.text_height);
+    long long cursor = wrap.rowOf(config.current_y) + rx / width;
+    long long top = editorTopRow();
+    if (cursor < top) top = cursor;
+    if (cursor >= top + config.text_height) top = cursor - config.text_height + 1;
+    config.offset_y = wrap.lineAt(top, config.offset_row);
+    config.offset_x = 0;
+    config.cursor_x = rx % width;
+    config.cursor_y = cursor - top;
+    editorWrapLater();
+}
+
+// keep the cursor on screen and work out where on screen it is
+void editorScroll() {
+    int rx = config.getCurrentRow()->charToRender(config.current_x);
+    if (config.soft_wrap) {
+        editorScrollWrapped(rx);
+        return;
+    }
+    if (config.current_y < config.offset_y) config.offset_y = config.current_y;
+    if (config.current_y >= config.offset_y + config.text_height)
+        config.offset_y = config.current_y - config.text_height + 1;
+    if (rx < config.offset_x) config.offset_x = rx;
+    if (rx >= config.offset_x + config.terminal_width)
+        config.offset_x = rx - config.terminal_width + 1;
+    config.cursor_x = rx - config.offset_x;
+    config.cursor_y = config.current_y - config.offset_y;
+}
+
+// forget rows that are far from the viewport
+void editorTrimRows() {
+    int keep_from = config.offset_y - config.text_height;
+    int keep_to = config.offset_y + 2 * config.text_height;
+    config.rows.erase(config.rows.begin(), config.rows.lower_bound(keep_from));
+    config.rows.erase(config.rows.lower_bound(keep_to), config.rows.end());
+    row_arena.trim();
+}
+
+// the text under the rows is gone: they go, and so do their slabs
+void editorClearRows() {
+    config.rows.clear();
+    row_arena.reclaim();
+}
+
+void editorRefreshScreen() {
+    static long long last_top = 0;
+    editorScroll();
+    editorTrimRows();
+    screen.resize(config.terminal_width, config.terminal_height);
+    screen.clear();
+    // measuring in the background may move the top row; a delta that is off only costs bytes
+    long long top = config.soft_wrap ? editorTopRow() : config.offset_y;
+    if (top != last_top) {
+        long long delta = max(-(long long)config.text_height, min(top - last_top, (long long)config.text_height));
+        screen.scroll(0, config.text_height, delta);
+        last_top = top;
+    }
+
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+
+    screen.flush(write_buffer, config.cursor_x, config.cursor_y);
+    config.redraw = false;
+    config.last_frame = editorNow();
+}
+
+// ctrl-t tells what drawing costs, and every other time what memory goes to.
+// text that only the undo history keeps is counted there and not as text
+void editorShowStats() {
+    static bool memory = false;
+    memory = !memory;
+    if (!memory) {
+        size_t index = memory_used[MEM_INDEX] + config.wrap.bytes()
+            + config.syntax_states.capacity() * sizeof(int);
+        long long text = max(0LL, memory_used[MEM_TEXT] - (long long)config.undo.text);
+        editorSetStatusMessage(
+            "text %lldKB (+%lldKB mapped) | rows %zu/%zuKB | index %zuKB | undo %zuKB",
+            text >> 10, memory_used[MEM_MAPPED] >> 10,
+            row_arena.live >> 10, row_arena.held >> 10, index >> 10, config.undo.bytes >> 10
+        );
+        return;
+    }
+    editorSetStatusMessage(
+        "frames %zu (last %zuB/%zuw, total %zuB/%zuw), %zu reads"
+        " | undo %zu steps, %zu ops, %zu/%zuKB",
+        screen.frames, screen.last_frame_bytes, write_buffer.last_syscalls,
+        screen.total_bytes, write_buffer.syscalls, input.reads,
+        config.undo.steps(), config.undo.size(), config.undo.bytes >> 10, config.undo.limit >> 10
+    );
+}
+
+// a background thread woke us up: pick up whatever it has finished
+void editorJumpToOffset(size_t offset);
+
+void editorPollSearch() {
+    SearchWorker *worker = config.search_worker;
+    if (worker == nullptr) return;
+    size_t nearest = worker->nearest;
+    if (nearest != std::string::npos && config.search_match == std::string::npos) {
+        config.search_match = nearest;
+        editorJumpToOffset(nearest);
+    }
+    if (worker->done) {
+        config.search_count = worker->count;
+        config.search_index = worker->index;
+        delete worker;
+        config.search_worker = nullptr;
+    }
+}
+
+void editorCancelSearch() {
+    delete config.search_worker;
+    config.search_worker = nullptr;
+    config.search_count = -1;
+}
+
+void editorPollSave(bool wait);
+void editorPollFollow();
+void editorBufferAppendFile(const TextSpan &span);
 
-    char current_status[80];
-    int current_status_length = snprintf(
-        current_status, sizeof(current_status),
-        "%d, %d", config.getCurrentY(), config.getCurrentX()
-    );
-    if (current_status_length + status_length < config.terminal_width) {
-        for (int t = 0; t < config.terminal_width - status_length - current_status_length; t++)
-            write_buffer.append(" ", 1);
-        write_buffer.append(current_status, current_status_length);
+// puts what the stream loader read at the end of the buffer
+void editorPollStream() {
+    StreamLoader *loader = config.loader;
+    if (loader == nullptr) return;
+    bool done = loader->done;
+    std::vector<TextSpan> spans;
+    loader->take(spans);
+    for (size_t i = 0; i < spans.size(); i++) {
+        TextBlock *block = spans[i].block;
+        block->size = max(block->size, spans[i].start + spans[i].length);
+        editorBufferAppendFile(spans[i]);
+        block->release();
+    }
+    if (!done) return;
+    if (loader->error) {
+        editorSetStatusMessage("Can't read %s: %s", loader->name.c_str(), strerror(loader->error));
     } else {
-        for (int t = 0; t < config.terminal_width - status_length; t++)
-            write_buffer.append(" ", 1);
+        editorSetStatusMessage("Read %zu bytes from %s", (size_t)loader->received, loader->name.c_str());
     }
-    write_buffer.append("\033[m", 3);
-#ifdef DEBUG
-    write_buffer.writeBuffer();
-#endif
+    delete loader;
+    config.loader = nullptr;
 }
 
-void editorSetStatusMessage(const char *fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    config.status_message_length = vsnprintf(
-        config.status_message, sizeof(config.status_message), fmt, ap
-    );
-    config.status_message_length = min(config.terminal_width, config.status_message_length);
-    va_end(ap);
-    config.status_message_time = time(NULL);
+void editorPollBackground() {
+    if (config.document.pollIndex()) config.n_rows = config.document.lineCount();
+    editorPollSearch();
+    editorPollSave(false);
+    editorPollFollow();
+    editorPollStream();
 }
 
-void editorDrawMessageBar() {
-    write_buffer.append("\r\n", 2);
-    if (config.status_message_length && time(NULL) - config.status_message_time < 5) {
-        write_buffer.append(config.status_message, config.status_message_length);
+void editorOnTimer(int timer) {
+    switch (timer) {
+        case TIMER_MESSAGE:
+            config.redraw = true;
+            break;
+        case TIMER_JOURNAL:
+            if (!config.journal.flush()) {
+                editorSetStatusMessage("Can't write %s: %s", config.journal.path.c_str(), strerror(errno));
+            }
+            break;
+        case TIMER_WRAP:
+            if (config.soft_wrap && config.wrap.measureSome(WRAP_BUDGET)) events.setTimer(TIMER_WRAP, 0);
+            break;
     }
-    write_buffer.append("\033[K", 3);
-#ifdef DEBUG
-    write_buffer.writeBuffer();
-#endif
 }
 
-void editorRefreshScreen() {
-    write_buffer.append("\033[?25l", 6);
-    // write_buffer.append("\033[2J", 4); // (no need now)
-    write_buffer.append("\033[H", 3);
-    // write(STDOUT_FILENO, "\033[2J", 4);
-    // write(STDOUT_FILENO, "\033[H", 3);
+void editorHandleResize();
 
-    editorDrawRows();
-    editorDrawStatusBar();
-    editorDrawMessageBar();
+// one turn of the event loop: wait for input, a resize, a timer or news from
+// a background thread, and draw a frame when one is due. frames are limited
+// to max_fps; with nothing to do we sleep in poll(2) without a timeout
+void editorWaitForEvents() {
+    // input that has already arrived is handled before anything is drawn
+    if (input.fill(0) > 0) return;
 
-    // write_buffer.append("\033[H", 3);
-    char temp[30];
-    int temp_length = snprintf(
-            temp, sizeof(temp),
-            "\033[%d;%dH", config.cursor_y + 1, config.cursor_x + 1
-    );
-    write_buffer.append(temp, temp_length);
+    long long now = editorNow();
+    int timeout = -1;
+    if (config.redraw) {
+        long long due = config.last_frame + 1000 / config.max_fps;
+        if (now >= due) editorRefreshScreen();
+        else timeout = due - now;
+    }
+    long long timer = events.nextTimer();
+    if (timer) {
+        int until = max(0LL, timer - now);
+        timeout = timeout < 0 ? until : min(timeout, until);
+    }
 
-    write_buffer.append("\033[?25h", 6);
-    // write(STDOUT_FILENO, "\033[H", 3);
-    write_buffer.writeBuffer();
+    pollfd fds[3] = {
+        {STDIN_FILENO, POLLIN, 0},
+        {events.wake_pipe[0], POLLIN, 0},
+        {config.follow.notify_fd, POLLIN, 0} // ignored while it is -1
+    };
+    if (poll(fds, 3, timeout) == -1 && errno != EINTR) die("poll");
+    if (fds[1].revents & POLLIN) {
+        events.drain();
+        if (events.resized.exchange(false)) editorHandleResize();
+        editorPollBackground();
+        config.redraw = true;
+    }
+    if (fds[2].revents & POLLIN) {
+        config.follow.drain();
+        editorPollFollow();
+    }
+    if (fds[0].revents & POLLIN) input.fill(0);
+
+    now = editorNow();
+    for (int i = 0; i < TIMER_COUNT; i++) {
+        if (events.timers[i] && events.timers[i] <= now) {
+            events.timers[i] = 0;
+            editorOnTimer(i);
+        }
+    }
 }
 
 // since some keys consist of more than one byte, use a function to read
 int editorReadKey() {
-    char ch = '\0';
-    int nread;
-    while ((nread = read(STDIN_FILENO, &ch, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
-    }
-    if (ch == '\033') {
-        char ch1, ch2, ch3;
-        if (read(STDIN_FILENO, &ch1, 1) != 1) return '\033';
-        if (read(STDIN_FILENO, &ch2, 1) != 1) return '\033';
-        if (ch1 == '[') {
-            if (ch2 >= '0' && ch2 <= '9') {
-                if (read(STDIN_FILENO, &ch3, 1) != 1) return '\033';
-                if (ch3 == '~') {
-                    switch (ch2) {
-                        case '1':
-                        case '7':
-                            return HOME;
-                        case '4':
-                        case '8':
-                            return END;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '3': return DELETE;
-                    }
-                }
-            } else {
-                switch (ch2) {
-                    case 'A': return CURSOR_UP;
-                    case 'B': return CURSOR_DOWN;
-                    case 'C': return CURSOR_RIGHT;
-                    case 'D': return CURSOR_LEFT;
-                    case 'H': return HOME;
-                    case 'F': return END;
-                }
-            }
-        } else if (ch1 == 'O') {
-            switch (ch2) {
-                case 'H': return HOME;
-                case 'F': return END;
-            }
-        }
-        return '\033';
-    }
-    return ch;
+    while (!input.buffered()) editorWaitForEvents();
+    return input.decode();
 }
 
 // WARNING: might return nullptr
-char *editorPrompt(const char *format) {
-    char *buf = new char[MAXLINE];
+// callback, if any, sees the text after every key, including ESC and Enter
+char *editorPrompt(const char *format, void (*callback)(const char *, int) = nullptr,
+                   bool allow_empty = false) {
+    char *buf = (char *)malloc(MAXLINE + 1);
     int len = 0;
     buf[len] = '\0';
     while (1) {
         editorSetStatusMessage(format, buf);
-        editorRefreshScreen();
+        config.redraw = true;
 
         int key = editorReadKey();
         if (key == '\033') {
             editorSetStatusMessage("");
+            if (callback) callback(buf, key);
             free(buf);
             return nullptr;
         } else if (key == BACKSPACE || key == CTRL_KEY('h')) {
-            if (len > 0) buf[--len] = '\0';
+            // a whole UTF-8 char goes
+            while (len > 0 && isContinuation(buf[--len])) {}
+            buf[len] = '\0';
         } else if (key == '\r') {
-            if (len != 0) {
+            if (len != 0 || allow_empty) {
                 editorSetStatusMessage("");
+                if (callback) callback(buf, key);
                 return buf;
             }
-        } else if (!iscntrl(key) && key < 128 && key > 0) {
+        } else if (key >= ' ' && key < 256 && key != BACKSPACE) {
             if (len == MAXLINE) {
+                if (callback) callback(buf, key);
                 return buf;
             }
             buf[len++] = key;
             buf[len] = '\0';
         }
+        if (callback) callback(buf, key);
     }
 }
 
 bool editorSetCursorX(int x) {
-    if (x >= 0 && x <= config.editor_rows[config.getCurrentY()].length) {
-        int now_x = config.getCurrentX();
-        if (x < now_x) {
-            if (now_x - x <= config.cursor_x) {
-                config.cursor_x -= now_x - x;
-            } else {
-                config.offset_x -= now_x - x - config.cursor_x;
-                config.cursor_x = 0;
-            }
-        } else {
-            if (x - now_x <= config.terminal_width - 1 - config.cursor_x) {
-                config.cursor_x += x - now_x;
-            } else {
-                config.offset_x += x - now_x - (config.terminal_width - 1 - config.cursor_x);
-                config.cursor_x = config.terminal_width - 1;
-            }
-        }
+    if (x >= 0 && x <= config.getCurrentRow()->length) {
+        config.current_x = x;
         return true;
     } else return false;
 }
 
+// put the cursor on row y, char x; the view follows on the next frame
+void editorJumpTo(int y, int x) {
+    config.current_y = max(0, y);
+    config.current_x = max(0, x);
+}
+
 bool editorSetCursorY(int y) {
-    if (y < 0 || y > config.editor_rows[config.getCurrentY()].length) {
-        int now_y = config.getCurrentY();
-        if (y < now_y) {
-            if (now_y - y <= config.cursor_y) {
-                config.cursor_y -= now_y - y;
-            } else {
-                config.offset_y -= now_y - y - config.cursor_y;
-                config.cursor_y = 0;
-            }
-        } else {
-            if (y - now_y <= config.terminal_height - 1 - config.cursor_y) {
-                config.cursor_y += y - now_y;
-            } else {
-                config.offset_y += y - now_y - (config.terminal_height - 1 - config.cursor_y);
-                config.cursor_y = config.terminal_height - 1;
-            }
-        }
+    if (y >= 0 && y < max(config.n_rows, 1)) {
+        config.current_y = y;
         return true;
     } else return false;
 }
 
+// keeps the cursor in the row, at the start of a char
 void editorCursorHorizontalCheck() {
-    int maxlen = config.getMaxLength();
-    if (config.getCurrentX() >= maxlen) {
-        if (config.getCurrentX() < config.terminal_width) {
-            config.cursor_x = max(0, maxlen - config.offset_x);
-            config.offset_x = 0;
-        } else {
-            // edit mode: maxlen + 1
-            config.offset_x = max(0, maxlen + 1 - config.terminal_width);
-            config.cursor_x = maxlen - config.offset_x;
-        }
-    }
+    config.current_x = config.getCurrentRow()->snapChar(min(config.current_x, config.getMaxLength()));
+}
+
+// moves the cursor by screen rows of wrapped text, staying in the same
+// screen column where the row is long enough
+void editorMoveWrapped(int rows) {
+    WrapIndex &wrap = config.wrap;
+    int width = config.terminal_width;
+    int rx = config.getCurrentRow()->charToRender(config.current_x);
+    editorEnsureRows(config.current_y + max(rows, 0) + 2);
+    wrap.sync(config.n_rows);
+    long long row = wrap.rowOf(config.current_y) + rx / width + rows;
+    int sub;
+    config.current_y = wrap.lineAt(row, sub);
+    EditorRow *current = config.getCurrentRow();
+    int x = current->renderToChar(sub * width + rx % width);
+    // a tab or a wide char that starts on the row above belongs there
+    if (x < current->length && current->charToRender(x) < sub * width) x = current->nextChar(x);
+    config.current_x = x;
 }
 
 void editorMoveCursor(int key) {
+    if (config.soft_wrap && (key == CURSOR_UP || key == CURSOR_DOWN)) {
+        editorMoveWrapped(key == CURSOR_UP ? -1 : 1);
+        return;
+    }
     switch (key) {
         // case 'j':
         case CURSOR_DOWN:
-            if (config.getCurrentY() < config.n_rows - 1) {
-                if (config.cursor_y < config.text_height - 1) {
-                    config.cursor_y++;
-                } else {
-                    config.offset_y++;
-                }
-            }
+            editorEnsureRows(config.getCurrentY() + 2);
+            if (config.getCurrentY() < config.n_rows - 1) config.current_y++;
             editorCursorHorizontalCheck();
             break;
         // case 'k':
         case CURSOR_UP:
-            if (config.cursor_y > 0) {
-                config.cursor_y--;
-            } else {
-                if (config.offset_y > 0) config.offset_y--;
-            }
+            if (config.current_y > 0) config.current_y--;
             editorCursorHorizontalCheck();
             break;
         // case 'h':
         case CURSOR_LEFT:
-            if (config.cursor_x > 0) {
-                config.cursor_x--;
-            } else {
-                if (config.offset_x > 0) config.offset_x--;
-            }
+            config.current_x = config.getCurrentRow()->prevChar(config.current_x);
             break;
         // case 'l':
         case CURSOR_RIGHT:
-            if (config.getCurrentX() < config.getMaxLength()) {
-                if (config.cursor_x + 1 < config.terminal_width) {
-                    config.cursor_x++;
-                } else {
-                    if (config.getCurrentX() < config.getMaxLength()) config.offset_x++;
-                }
-            }
+            config.current_x = config.getCurrentRow()->nextChar(config.current_x);
             break;
     }
 }
 
-void editorInsertChar(char ch) {
-    if (config.n_rows == 0) config.n_rows = 1;
-    config.editor_rows[config.getCurrentY()].insertChar(config.getCurrentX(), ch);
-    editorMoveCursor(CURSOR_RIGHT);
+// lines [line, line + removed] were replaced by [line, line + added], and
+// every byte after the edit moved by `shift`. cached rows past the edit
+// move along, rows inside it are dropped
+void editorRowsChanged(int line, int removed, int added, long long shift) {
+    RowCache moved;
+    RowCache::iterator it = config.rows.lower_bound(line);
+    while (it != config.rows.end()) {
+        if (it->first > line + removed) {
+            EditorRow &row = moved[it->first + added - removed];
+            row.swap(it->second);
+            row.offset += shift;
+        }
+        config.rows.erase(it++);
+    }
+    config.rows.insert(moved.begin(), moved.end());
+}
+
+// lines [line, line + removed] became [line, line + added]. the wrap index
+// follows, and so do the lexer states: those of new lines are unknown, and
+// the one of the edited line is kept to see if the lines below still hold
+void editorLinesChanged(int line, int removed, int added) {
+    if (config.soft_wrap) config.wrap.change(line, removed, added);
+    std::vector<int> &states = config.syntax_states;
+    if (line >= (int)states.size()) return;
+    states.erase(states.begin() + line + 1, states.begin() + min(line + 1 + removed, (int)states.size()));
+    states.insert(states.begin() + line + 1, added, LEX_UNKNOWN);
+    if (states[line] != LEX_UNKNOWN) states[line] |= LEX_STALE;
+}
+
+// the journal is fsynced a little after the first edit that is not on disk
+void editorJournalChanged() {
+    if (config.journal.hasPending() && events.timers[TIMER_JOURNAL] == 0) {
+        events.setTimer(TIMER_JOURNAL, JOURNAL_SYNC_INTERVAL);
+    }
+}
+
+// swaps in a rewritten copy of the whole text as a single edit
+void editorBufferReplaceAll(const std::vector<TextBlock *> &blocks) {
+    config.undo.begin();
+    config.undo.recordErase(config.document, 0, config.document.size());
+    config.journal.erase(0, config.document.size());
+    config.document.load(blocks);
+    config.undo.recordInsert(config.document, 0, config.document.size());
+    config.undo.end();
+    size_t at = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        config.journal.insert(at, blocks[i]->data, blocks[i]->size);
+        at += blocks[i]->size;
+    }
+    editorJournalChanged();
+    editorClearRows();
+    config.wrap.clear();
+    config.syntax_states.clear();
+    config.n_rows = config.document.lineCount();
+    config.current_y = min(config.current_y, max(config.n_rows - 1, 0));
+    editorCursorHorizontalCheck();
+    editorCancelSearch();
+    config.dirty = true;
+}
+
+// keeps the row cache in step with `length` bytes that were just inserted
+// at `at`, on what used to be line `line`, `added` of them line breaks.
+// without `str` at hand the row is loaded again instead of patched
+void editorRowsInserted(int line, size_t at, size_t length, int added, const char *str) {
+    RowCache::iterator it = config.rows.find(line);
+    if (str && added == 0 && it != config.rows.end() && at <= it->second.offset + it->second.length) {
+        // an edit inside one row just patches the cached row
+        it->second.insert(at - it->second.offset, str, length);
+        editorRowsChanged(line + 1, 0, 0, length);
+    } else {
+        editorRowsChanged(line, 0, added, length);
+    }
+    editorLinesChanged(line, 0, added);
+    config.n_rows = config.document.lineCount();
+    editorCancelSearch();
+}
+
+// every change to the text goes through these
+void editorBufferInsert(size_t at, const char *str, size_t length) {
+    int line = config.document.lineOf(at);
+    config.document.insert(at, str, length);
+    editorRowsInserted(line, at, length, std::count(str, str + length, '\n'), str);
     config.dirty = true;
+    config.undo.recordInsert(config.document, at, length);
+    config.journal.insert(at, str, length);
+    editorJournalChanged();
 }
 
-void editorDeleteRow(int at) {
-    if (at < 0 || at >= config.n_rows) return;
-    config.editor_rows[at].deleteRow();
-    memmove(config.editor_rows + at, config.editor_rows + at + 1, sizeof(EditorRow) * (config.n_rows - at - 1));
-    config.n_rows--;
+void editorBufferInsertSpan(size_t at, const TextSpan &span) {
+    int line = config.document.lineOf(at);
+    config.document.insertPiece(at, span.block, span.start, span.length);
+    editorRowsInserted(line, at, span.length, span.block->countNewlines(span.start, span.start + span.length),
+                       span.block->data + span.start);
     config.dirty = true;
+    config.undo.recordInsert(config.document, at, span.length);
+    config.journal.insert(at, span.block->data + span.start, span.length);
+    editorJournalChanged();
 }
 
-void editorInsertRow(int at) {
-    if (at < 0 || at > config.n_rows) return;
-    memmove(config.editor_rows + at + 1, config.editor_rows + at, sizeof(EditorRow) * (config.n_rows - at));
-    config.editor_rows[at].deleteRow();
-    config.n_rows++;
+// pastes a whole document, such as the clipboard. its pieces are spliced
+// in, so the text is not copied however big it is
+void editorBufferInsertDocument(size_t at, const Document &text) {
+    size_t length = text.size();
+    if (length == 0) return;
+    int line = config.document.lineOf(at);
+    config.document.insertDocument(at, text);
+    editorRowsInserted(line, at, length, text.newlines(), nullptr);
+    config.dirty = true;
+    config.undo.recordInsert(config.document, at, length);
+    config.journal.insert(at, text);
+    editorJournalChanged();
+}
+
+void editorBufferErase(size_t at, size_t length) {
+    config.undo.recordErase(config.document, at, length);
+    config.journal.erase(at, length);
+    editorJournalChanged();
+    int line = config.document.lineOf(at);
+    int removed = config.document.lineOf(at + length) - line;
+    RowCache::iterator it = config.rows.find(line);
+    if (removed == 0 && it != config.rows.end() && at + length <= it->second.offset + it->second.length) {
+        it->second.erase(at - it->second.offset, length);
+        editorRowsChanged(line + 1, 0, 0, -(long long)length);
+    } else {
+        editorRowsChanged(line, removed, 0, -(long long)length);
+    }
+    editorLinesChanged(line, removed, 0);
+    config.document.erase(at, length);
+    config.n_rows = config.document.lineCount();
+    editorCancelSearch();
     config.dirty = true;
 }
 
+// text that arrived at the end of the followed file or of the stream we
+// read. it was written by someone else, so it is neither an edit to undo
+// nor one to journal. while following, a cursor on the last line stays
+// there, so the view sticks to the end until the user moves away
+void editorBufferAppendFile(const TextSpan &span) {
+    if (span.length == 0) return;
+    bool pinned = config.follow.isOn() && config.current_y >= config.n_rows - 1;
+    size_t at = config.document.size();
+    int line = config.document.lineOf(at);
+    config.document.insertPiece(at, span.block, span.start, span.length);
+    editorRowsInserted(line, at, span.length, span.block->countNewlines(span.start, span.start + span.length),
+                       span.block->data + span.start);
+    if (pinned) editorJumpTo(max(config.n_rows - 1, 0), 0);
+    config.file_size += span.length;
+}
+
+void editorInsertChar(char ch) {
+    EditorRow *row = config.getCurrentRow();
+    int x = min(config.getCurrentX(), row->length);
+    editorBufferInsert(row->offset + x, &ch, 1);
+    // the bytes of a UTF-8 char arrive one by one
+    config.current_x = x + 1;
+}
+
+// inserts a whole block of text (a paste) at the cursor as a single edit
+void editorInsertText(const char *str, size_t length) {
+    std::string text;
+    text.reserve(length);
+    for (size_t i = 0; i < length; i++) {
+        // terminals send line breaks in a paste as '\r'
+        if (str[i] == '\r') {
+            text.push_back('\n');
+            if (i + 1 < length && str[i + 1] == '\n') i++;
+        } else text.push_back(str[i]);
+    }
+    if (text.empty()) return;
+
+    EditorRow *row = config.getCurrentRow();
+    int x = min(config.getCurrentX(), row->length);
+    int y = config.getCurrentY();
+    editorBufferInsert(row->offset + x, text.data(), text.size());
+    size_t last_newline = text.rfind('\n');
+    if (last_newline == std::string::npos) {
+        x += text.size();
+    } else {
+        for (size_t i = 0; i < text.size(); i++) y += text[i] == '\n';
+        x = text.size() - last_newline - 1;
+    }
+    editorEnsureRows(y + 1);
+    editorJumpTo(y, x);
+}
+
 void editorDeleteChar(bool backspace) {
-    int ch = 0;
+    int y = config.getCurrentY();
+    EditorRow *row = config.getCurrentRow();
+    int x = min(config.getCurrentX(), row->length);
     if (backspace) {
-        int y = config.getCurrentY();
-        ch = config.editor_rows[y].deleteChar(config.getCurrentX() - 1);
-        if (ch == UP_LINE_FEED && y > 0) {
-            int idx = config.editor_rows[y - 1].length;
-            config.editor_rows[y - 1].appendString(
-                config.editor_rows[y].str,
-                config.editor_rows[y].length
-            );
-            editorDeleteRow(y);
+        if (x > 0) {
+            int from = row->prevChar(x);
+            editorBufferErase(row->offset + from, x - from);
+            config.current_x = from;
+        } else if (y > 0) {
+            // join with the row above by removing its line break
+            EditorRow *prev = config.getRow(y - 1);
+            int idx = prev->length;
+            size_t line_end = prev->offset + prev->length;
+            editorBufferErase(line_end, row->offset - line_end);
             editorMoveCursor(CURSOR_UP);
             editorSetCursorX(idx);
-        } else {
-            editorMoveCursor(CURSOR_LEFT);
         }
     } else {
-        int y = config.getCurrentY();
-        ch = config.editor_rows[y].deleteChar(config.getCurrentX());
-        if (ch == DOWN_LINE_FEED && y < config.n_rows - 1) {
-            config.editor_rows[y].appendString(
-                config.editor_rows[y + 1].str,
-                config.editor_rows[y + 1].length
-            );
-            editorDeleteRow(y + 1);
+        if (x < row->length) {
+            editorBufferErase(row->offset + x, row->nextChar(x) - x);
+        } else if (y < config.n_rows - 1) {
+            size_t line_end = row->offset + row->length;
+            editorBufferErase(line_end, config.getRow(y + 1)->offset - line_end);
         }
     }
-    config.dirty = true;
 }
 
 void editorInsertNewline() {
-    int x = config.getCurrentX();
-    int y = config.getCurrentY();
-    int len = config.editor_rows[y].length - x;
-    editorInsertRow(y + 1);
-    config.editor_rows[y + 1].appendString(
-        config.editor_rows[y].str + x,
-        len
-    );
-    config.editor_rows[y].shrinkString(len);
-    // editorSetCursorX(0);
-    // editorSetCursorY(y + 1);
+    EditorRow *row = config.getCurrentRow();
+    int x = min(config.getCurrentX(), row->length);
+    editorBufferInsert(row->offset + x, "\n", 1);
     editorMoveCursor(CURSOR_DOWN);
     editorSetCursorX(0);
 }
 
-char *editorRowsToString(int &text_length) {
-    text_length = 0;
-    for (int i = 0; i < config.n_rows; i++) {
-        text_length += config.editor_rows[i].length + 1; // 1 for '\n'
+// applies a logged operation, or its inverse, and returns where the cursor goes
+size_t editorApplyUndoOp(const UndoOp &op, bool inverse) {
+    if (op.insert == inverse) {
+        editorBufferErase(op.at, op.length);
+        return op.at;
     }
-    char *ret = new char[text_length];
-    char *ptr = ret;
-    for (int i = 0; i < config.n_rows; i++) {
-        memcpy(ptr, config.editor_rows[i].str, config.editor_rows[i].length);
-        ptr += config.editor_rows[i].length;
-        *ptr = '\n';
-        ptr++;
+    size_t at = op.at;
+    config.undo.forEachSpan(op, [&](const TextSpan &span) {
+        editorBufferInsertSpan(at, span);
+        at += span.length;
+    });
+    return at;
+}
+
+void editorUndo(bool redo) {
+    size_t cursor = std::string::npos;
+    int count = 0;
+    auto apply = [&](const UndoOp &op, bool inverse) {
+        cursor = editorApplyUndoOp(op, inverse);
+        count++;
+    };
+    if (redo ? config.undo.redo(apply) : config.undo.undo(apply)) {
+        if (count == 1) {
+            editorJumpToOffset(cursor);
+        } else {
+            // a bulk edit like replace-all leaves the cursor where it is
+            config.current_y = min(config.current_y, max(config.n_rows - 1, 0));
+            editorCursorHorizontalCheck();
+        }
+    } else {
+        editorSetStatusMessage(redo ? "Nothing to redo" : "Nothing to undo");
     }
-    ret[text_length] = '\0';
-    return ret;
+}
+
+// highlighting goes by the file name
+void editorSelectSyntax() {
+    const Syntax *syntax = findSyntax(config.filename);
+    if (syntax == config.syntax) return;
+    config.syntax = syntax;
+    editorClearRows();
+    config.syntax_states.clear();
 }
 
 void editorSave() {
+    if (config.save_worker) {
+        editorSetStatusMessage("Already saving");
+        return;
+    }
     if (config.filename == nullptr) {
         config.filename = editorPrompt("Save as: %s");
         if (config.filename == nullptr) {
             editorSetStatusMessage("Save aborted");
             return;
         }
+        editorSelectSyntax();
     }
-    int total_length = 0;
-    char *total_str = editorRowsToString(total_length);
+    // the worker writes a snapshot, so editing goes on meanwhile and
+    // anything typed from now on makes the buffer dirty again
+    config.journal.mark();
+    config.save_worker = new SaveWorker(config.document, config.filename, config.base, config.base_st);
+    config.dirty = false;
+}
 
-    int fd = open(config.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1 && ftruncate(fd, total_length) != -1) {
-        write(fd, total_str, total_length);
-        close(fd);
-        free(total_str);
-        config.dirty = false;
-        editorSetStatusMessage("Saved");
+// picks up a finished save, or waits for it
+void editorPollSave(bool wait) {
+    SaveWorker *worker = config.save_worker;
+    if (worker == nullptr || (!wait && !worker->done)) return;
+    worker->thread.join();
+    if (worker->error) {
+        config.dirty = true;
+        editorSetStatusMessage("Can't save %s: %s", worker->path.c_str(), strerror(worker->error));
+    } else {
+        if (worker->in_place) {
+            config.base_st = worker->st;
+        } else if (config.base) {
+            // a new file took the place of the one we mapped
+            config.base->release();
+            config.base = nullptr;
+        }
+        // from now on the file grows from what we wrote
+        config.file_size = worker->st.st_size;
+        if (config.follow.isOn()) config.follow.start(config.filename, config.file_size);
+        // the saved file is the new base of the journal
+        bool journaled = config.journal.isOpen() ? config.journal.rebase(worker->st)
+                                                 : config.journal.start(config.filename, worker->st);
+        const char *how = worker->in_place ? "in place" : "to disk";
+        if (journaled) {
+            editorSetStatusMessage("%zu bytes written %s", (size_t)worker->written, how);
+        } else {
+            editorSetStatusMessage("%zu bytes written %s, can't write %s: %s", (size_t)worker->written, how,
+                                   config.journal.path.c_str(), strerror(errno));
+        }
+    }
+    delete worker;
+    config.save_worker = nullptr;
+}
+
+bool editorReload();
+
+// picks up what the followed file grew by, or reloads it once it was
+// rotated. nothing is read while we save, since the save itself replaces
+// the file
+void editorPollFollow() {
+    FileFollower &follow = config.follow;
+    if (!follow.isOn() || config.save_worker) return;
+    TextBlock *grown = nullptr;
+    int what = follow.poll(grown);
+    if (grown) {
+        grown->retain();
+        TextSpan span = {grown, 0, grown->size};
+        editorBufferAppendFile(span);
+        config.redraw = true;
+        // there may be more, come back after this frame
+        if (grown->size == FOLLOW_READ_MAX) editorWake();
+        grown->release();
+        // the edits in the journal now apply to the grown file
+        if (!config.journal.retarget(follow.st)) {
+            editorSetStatusMessage("Can't write %s: %s", config.journal.path.c_str(), strerror(errno));
+        }
+    }
+    if (what != FileFollower::ROTATED) return;
+    if (config.dirty) {
+        follow.stop();
+        editorSetStatusMessage("%s was rotated, stopped following to keep your changes", config.filename);
+    } else if (editorReload()) {
+        editorSetStatusMessage("%s was rotated, reloaded", config.filename);
     } else {
-        editorSetStatusMessage("Failed to save");
+        follow.stop();
+        editorSetStatusMessage("Can't follow %s: %s", config.filename, strerror(errno));
     }
+    config.redraw = true;
+}
 
-    // free(config.filename);
-    // config.filename = nullptr;
+// long lines either go on in the next screen rows or scroll sideways; the
+// wrap index starts over either way
+void editorToggleWrap() {
+    config.soft_wrap = !config.soft_wrap;
+    config.offset_x = 0;
+    config.offset_row = 0;
+    config.wrap.clear();
+    config.wrap.width = config.terminal_width;
+    editorSetStatusMessage(config.soft_wrap ? "Soft wrap on" : "Soft wrap off");
 }
 
-void editorSearch() {
-    char *query = editorPrompt("Search (ESC to cancel): %s");
-    if (query == nullptr) return;
-    for (int i = config.getCurrentY(); i < config.n_rows; i++) {
-        EditorRow row = config.editor_rows[i];
-        char *match = strstr(row.rstr, query);
-        if (match != nullptr) {
-            editorSetStatusMessage("Found! %d, %d", i, match - row.rstr);
-            break;
+void editorToggleFollow() {
+    FileFollower &follow = config.follow;
+    if (follow.isOn()) {
+        follow.stop();
+        editorSetStatusMessage("Stopped following %s", config.filename);
+    } else if (config.filename == nullptr) {
+        editorSetStatusMessage("Nothing to follow, the buffer has no file");
+    } else if (!follow.start(config.filename, config.file_size)) {
+        editorSetStatusMessage("Can't follow %s: %s", config.filename, strerror(errno));
+    } else {
+        editorSetStatusMessage("Following %s, ctrl+l to stop", config.filename);
+        editorEnsureRows(INT_MAX);
+        editorJumpTo(max(config.n_rows - 1, 0), 0);
+        editorPollFollow();
+    }
+}
+
+size_t editorCursorOffset() {
+    return config.getCurrentRow()->offset + config.current_x;
+}
+
+void editorJumpToOffset(size_t offset) {
+    int y = config.document.lineOf(offset);
+    editorEnsureRows(y + 2);
+    editorJumpTo(y, offset - config.document.lineStart(y));
+}
+
+// hands the clipboard to the terminal for the system clipboard (OSC 52).
+// it is encoded and written out a piece at a time, so a big clipboard is
+// never held twice
+void editorExportClipboard() {
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const Document &clipboard = config.clipboard;
+    if (clipboard.size() > OSC52_MAX) {
+        editorSetStatusMessage("Copied %zu bytes, too many for the system clipboard", clipboard.size());
+        return;
+    }
+    std::string out("\033]52;c;");
+    unsigned char group[3];
+    int grouped = 0;
+    auto encode = [&]() {
+        unsigned bits = group[0] << 16 | (grouped > 1 ? group[1] << 8 : 0) | (grouped > 2 ? group[2] : 0);
+        for (int i = 0; i < 4; i++) out.push_back(i <= grouped ? digits[bits >> (18 - 6 * i) & 63] : '=');
+        grouped = 0;
+    };
+    clipboard.forEachChunk(0, clipboard.size(), [&](const char *str, size_t length) {
+        for (size_t i = 0; i < length; i++) {
+            group[grouped++] = str[i];
+            if (grouped < 3) continue;
+            encode();
+            if (out.size() < 64 * 1024) continue;
+            write_buffer.append(out.data(), out.size());
+            write_buffer.writeBuffer();
+            out.clear();
+        }
+    });
+    if (grouped > 0) encode();
+    out += "\a";
+    write_buffer.append(out.data(), out.size());
+    write_buffer.writeBuffer();
+}
+
+// the selection goes to the clipboard, in O(log n) however much it is
+bool editorCopy() {
+    size_t from, to;
+    if (!editorSelection(from, to)) {
+        editorSetStatusMessage("Nothing selected");
+        return false;
+    }
+    config.document.copyTo(from, to, config.clipboard);
+    editorSetStatusMessage("Copied %zu bytes", to - from);
+    if (config.osc52) editorExportClipboard();
+    return true;
+}
+
+void editorCut() {
+    size_t from, to;
+    if (!editorSelection(from, to) || !editorCopy()) return;
+    editorBufferErase(from, to - from);
+    editorJumpToOffset(from);
+}
+
+void editorPaste() {
+    if (config.clipboard.size() == 0) {
+        editorSetStatusMessage("Nothing to paste");
+        return;
+    }
+    EditorRow *row = config.getCurrentRow();
+    size_t at = row->offset + min(config.current_x, row->length);
+    editorBufferInsertDocument(at, config.clipboard);
+    editorJumpToOffset(at + config.clipboard.size());
+}
+
+// moves to the next (or previous) match of the search query, wrapping around
+// the ends of the buffer. while the cursor stays on the last match and
+// nothing is edited, only the distance to the next match is scanned;
+// otherwise one pass over the buffer counts the matches as well
+void editorFindNext(bool forward, bool skip_current) {
+    const Document &document = config.document;
+    const SearchPattern &pattern = config.search_pattern;
+    if (!pattern.valid()) return;
+    if (config.search_worker) editorCancelSearch();
+    size_t size = document.size();
+    size_t at = editorCursorOffset();
+    size_t start = forward && skip_current ? at + 1 : at;
+    size_t found = std::string::npos;
+    bool wrapped = false;
+    if (config.search_count > 0 && at == config.search_match) {
+        if (forward) {
+            found = pattern.find(document, start, size);
+            if (found == std::string::npos) found = pattern.find(document, 0, start);
+        } else {
+            found = pattern.findLast(document, 0, at);
+            if (found == std::string::npos) found = pattern.findLast(document, at, size);
+        }
+        wrapped = forward ? found < start : found >= at;
+        config.search_index += forward ? 1 : -1;
+        if (config.search_index > config.search_count) config.search_index = 1;
+        if (config.search_index < 1) config.search_index = config.search_count;
+    } else {
+        long long count = 0, index = 0, edge_index = 0;
+        size_t edge = std::string::npos; // where a wrapped search lands
+        pattern.forEachMatch(document, 0, size, [&](const SearchMatch &m) {
+            size_t match = m.at;
+            count++;
+            if (forward) {
+                if (match >= start && found == std::string::npos) {
+                    found = match;
+                    index = count;
+                }
+                if (edge == std::string::npos) {
+                    edge = match;
+                    edge_index = count;
+                }
+            } else {
+                if (match < at) {
+                    found = match;
+                    index = count;
+                }
+                edge = match;
+                edge_index = count;
+            }
+            return true;
+        });
+        if (found == std::string::npos && edge != std::string::npos) {
+            found = edge;
+            index = edge_index;
+            wrapped = true;
+        }
+        config.search_count = count;
+        config.search_index = index;
+    }
+    config.search_match = found;
+    if (found == std::string::npos) {
+        editorSetStatusMessage("No match for \"%s\"", config.search_query.c_str());
+        return;
+    }
+    editorJumpToOffset(found);
+    editorSetStatusMessage("Match %lld of %lld%s (^N next, ^P previous, ESC clears)",
+                           config.search_index, config.search_count, wrapped ? ", wrapped" : "");
+}
+
+// where the cursor was when the search prompt opened
+struct SearchOrigin {
+    size_t offset;
+    int x, y, offset_x, offset_y, offset_row;
+} search_origin;
+
+// runs on every key in the search prompt: a changed query drops the scan
+// in flight and starts over from where the prompt was opened
+void editorSearchCallback(const char *query, int key) {
+    if (key == '\r') return;
+    if (key == '\033' || config.search_query != query) {
+        editorCancelSearch();
+        config.search_match = std::string::npos;
+        config.current_x = search_origin.x;
+        config.current_y = search_origin.y;
+        config.offset_x = search_origin.offset_x;
+        config.offset_y = search_origin.offset_y;
+        config.offset_row = search_origin.offset_row;
+        config.search_query = key == '\033' ? "" : query;
+        config.search_pattern = SearchPattern(config.search_query, config.search_regex);
+        if (config.search_pattern.valid()) {
+            config.search_worker = new SearchWorker(config.document, config.search_pattern, search_origin.offset);
         }
     }
+}
+
+void editorSearch(bool regex) {
+    search_origin.offset = editorCursorOffset();
+    search_origin.x = config.current_x;
+    search_origin.y = config.current_y;
+    search_origin.offset_x = config.offset_x;
+    search_origin.offset_y = config.offset_y;
+    search_origin.offset_row = config.offset_row;
+    editorCancelSearch();
+    config.search_query.clear();
+    config.search_pattern = SearchPattern();
+    config.search_regex = regex;
+    char *query = editorPrompt(regex ? "Regex search (ESC to cancel): %s" : "Search (ESC to cancel): %s",
+                               editorSearchCallback);
+    free(query);
+}
+
+// rewrites every match of a regular expression in one pass, as one edit
+void editorReplaceAll() {
+    char *query = editorPrompt("Replace regex (ESC to cancel): %s");
+    if (query == nullptr) return;
+    SearchPattern pattern(query, true);
     free(query);
+    if (pattern.errorMessage()) {
+        editorSetStatusMessage("Bad regex: %s", pattern.errorMessage());
+        return;
+    }
+    char *with = editorPrompt("Replace with (ESC to cancel): %s", nullptr, true);
+    if (with == nullptr) return;
+    long long start = editorNow();
+    std::vector<TextBlock *> blocks;
+    long long count = replaceAll(config.document, pattern, with, blocks);
+    free(with);
+    if (count > 0) editorBufferReplaceAll(blocks);
+    editorSetStatusMessage("Replaced %lld matches in %lld ms", count, editorNow() - start);
+}
+
+// a line number, @ and a byte offset, or a percentage of the file. lines
+// and offsets map onto each other in O(log n), so any jump is instant
+void editorGoto() {
+    char *target = editorPrompt("Go to line, @offset or percent%% (ESC to cancel): %s");
+    if (target == nullptr) return;
+    bool at_offset = target[0] == '@';
+    char *end;
+    unsigned long long n = strtoull(target + at_offset, &end, 10);
+    bool percent = !at_offset && strcmp(end, "%") == 0;
+    size_t size = config.document.size();
+    if (end == target + at_offset || (*end != '\0' && !percent)) {
+        editorSetStatusMessage("Not a line, @offset or percent: %s", target);
+    } else if (at_offset) {
+        editorJumpToOffset(min<unsigned long long>(n, size));
+    } else if (percent) {
+        size_t offset = (size_t)((double)size * min<unsigned long long>(n, 100) / 100);
+        editorJumpToOffset(config.document.lineStart(config.document.lineOf(offset)));
+    } else {
+        int y = (int)min<unsigned long long>(max<unsigned long long>(n, 1), INT_MAX - 1) - 1;
+        editorEnsureRows(y + 1);
+        editorJumpTo(min(y, max(config.n_rows - 1, 0)), 0);
+    }
+    free(target);
 }
 
 void editorProcessKey(int key) {
     // printAsOutput(ch);
     static bool first = true;
+    // a run of typing, or of erasing, is undone in one step; anything else
+    // starts a new step
+    enum { KEY_OTHER, KEY_TYPE, KEY_ERASE };
+    static int last_kind = KEY_OTHER;
+    int kind = key == BACKSPACE || key == DELETE ? KEY_ERASE
+             : (key >= ' ' && key < 256 && key != BACKSPACE) || key == '\t' ? KEY_TYPE : KEY_OTHER;
+    if (kind == KEY_OTHER || kind != last_kind) config.undo.seal();
+    last_kind = kind;
+    // shift and a movement key select from where the cursor was. the
+    // selection lasts until any other key but copy; a key that edits
+    // replaces the selected text, in the same undo step
+    bool select = key & SHIFT;
+    key &= ~SHIFT;
+    if (select && config.mark == std::string::npos) config.mark = editorCursorOffset();
+    bool keep = select || key == CTRL_KEY('c');
+    size_t from, to;
+    bool replace = (kind != KEY_OTHER || key == '\r' || key == PASTE || key == CTRL_KEY('v'))
+        && editorSelection(from, to);
+    if (replace) {
+        config.mark = std::string::npos;
+        config.undo.begin();
+        editorBufferErase(from, to - from);
+        editorJumpToOffset(from);
+        if (kind == KEY_ERASE) {
+            config.undo.end();
+            return;
+        }
+    }
     switch (key) {
         // case 'h':
         // case 'j':
@@ -699,33 +6072,31 @@ void editorProcessKey(int key) {
             editorMoveCursor(key);
             break;
         case PAGE_UP:
-        case PAGE_DOWN:
-            for (int i = 0; i < config.terminal_height; i++) {
-                editorMoveCursor(key == PAGE_UP ? CURSOR_UP : CURSOR_DOWN);
+        case PAGE_DOWN: {
+            if (config.soft_wrap) {
+                editorMoveWrapped(key == PAGE_UP ? -config.terminal_height : config.terminal_height);
+                break;
             }
+            int y = config.current_y + (key == PAGE_UP ? -config.terminal_height : config.terminal_height);
+            editorEnsureRows(y + 1);
+            config.current_y = max(0, min(y, config.n_rows - 1));
+            editorCursorHorizontalCheck();
             break;
+        }
         case HOME:
-            config.offset_x = config.cursor_x = 0;
+            config.current_x = 0;
             break;
         case END:
-            {
-                int maxlen = config.getMaxLength();
-                if (maxlen > config.terminal_width) {
-                    config.offset_x = maxlen - config.terminal_width;
-                    config.cursor_x = config.terminal_width - 1;
-                } else {
-                    config.offset_x = 0;
-                    config.cursor_x = maxlen;
-                }
-            }
-            // config.cursor_x = config.terminal_width - 1;
+            config.current_x = config.getMaxLength();
             break;
         case CTRL_KEY('q'):
+            editorPollSave(true);
             if (first && config.dirty) {
                 editorSetStatusMessage("WARNING! File has unsaved changes. Press again to exit.");
                 first = false;
                 break;
             }
+            config.journal.remove();
             write_buffer.append("\033[2J", 4);
             // write(STDOUT_FILENO, "\033[2J", 4);
             write_buffer.append("\033[H", 3);
@@ -737,7 +6108,46 @@ void editorProcessKey(int key) {
             editorSave();
             break;
         case CTRL_KEY('f'):
-            editorSearch();
+        case CTRL_KEY('r'):
+            editorSearch(key == CTRL_KEY('r'));
+            break;
+        case CTRL_KEY('e'):
+            editorReplaceAll();
+            break;
+        case CTRL_KEY('g'):
+            editorGoto();
+            break;
+        case CTRL_KEY('w'):
+            config.show_counts = !config.show_counts;
+            break;
+        case CTRL_KEY('l'):
+            editorToggleFollow();
+            break;
+        case CTRL_KEY('o'):
+            editorToggleWrap();
+            break;
+        case CTRL_KEY('z'):
+        case CTRL_KEY('y'):
+            editorUndo(key == CTRL_KEY('y'));
+            break;
+        case CTRL_KEY('n'):
+        case CTRL_KEY('p'):
+            editorFindNext(key == CTRL_KEY('n'), true);
+            break;
+        case CTRL_KEY('t'):
+            editorShowStats();
+            break;
+        case CTRL_KEY('c'):
+            editorCopy();
+            break;
+        case CTRL_KEY('x'):
+            editorCut();
+            break;
+        case CTRL_KEY('v'):
+            editorPaste();
+            break;
+        case PASTE:
+            editorInsertText(input.paste.data(), input.paste.size());
             break;
         case '\r':
             editorInsertNewline();
@@ -751,37 +6161,124 @@ void editorProcessKey(int key) {
             break;
         case '\033':
         // case CTRL_KEY('l'):
-            // TODO
+            config.search_query.clear();
+            config.search_pattern = SearchPattern();
+            config.search_match = std::string::npos;
             break;
         default:
             editorInsertChar(key);
             break;
     }
+    if (replace) config.undo.end();
+    if (!keep) config.mark = std::string::npos;
 }
 
 void getTerminalSize() {
-    write(STDOUT_FILENO, "\033[999;999H", 10);
-    write(STDOUT_FILENO, "\033[6n", 4);
-    char str[20];
-    read(STDIN_FILENO, str, 20);
-    sscanf(str, "\033[%d;%dR", &config.terminal_height, &config.terminal_width);
+    winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != -1 && ws.ws_col != 0) {
+        config.terminal_height = ws.ws_row;
+        config.terminal_width = ws.ws_col;
+    } else {
+        // no luck with ioctl, ask the terminal where the far corner is
+        write(STDOUT_FILENO, "\033[999;999H", 10);
+        write(STDOUT_FILENO, "\033[6n", 4);
+        char str[20] = "";
+        pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) > 0) read(STDIN_FILENO, str, sizeof(str) - 1);
+        if (sscanf(str, "\033[%d;%dR", &config.terminal_height, &config.terminal_width) != 2) {
+            config.terminal_height = 24;
+            config.terminal_width = 80;
+        }
+    }
+    config.terminal_height = max(config.terminal_height, 3);
+    config.terminal_width = max(config.terminal_width, 1);
     config.text_height = config.terminal_height - 2;
-    write(STDOUT_FILENO, "\033[2J", 4);
-    write(STDOUT_FILENO, "\033[H", 3);
+}
+
+void editorHandleResize() {
+    getTerminalSize();
+    config.status_message_length = min(config.terminal_width, config.status_message_length);
+    if (config.soft_wrap && config.wrap.width != config.terminal_width) config.wrap.rewrap(config.terminal_width);
 }
 
 void editorInit() {
     enableRawMode();
     getTerminalSize();
-    config.editor_rows = new EditorRow[MAXLINE];
+    write(STDOUT_FILENO, "\033[2J", 4);
+    write(STDOUT_FILENO, "\033[H", 3);
+    events.init();
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSigwinch;
+    sigaction(SIGWINCH, &sa, nullptr);
     config.cursor_x = config.cursor_y = 0;
+    config.current_x = config.current_y = 0;
     config.n_rows = 0;
 
     config.offset_x = 0;
     config.offset_y = 0;
+    config.offset_row = 0;
+
+    editorSetStatusMessage("Help: ctrl+q=quit, ctrl+s=save, ctrl+f=search, ctrl+g=goto, ctrl+t=stats");
+
+}
+
+// the text of an open file in state st, or nullptr with errno set
+TextBlock *editorReadFile(int fd, const struct stat &st) {
+    TextBlock *block;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        // map the file and let the viewport decide how much of it gets indexed
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) return nullptr;
+        block = new TextBlock((char *)data, st.st_size);
+        if ((size_t)st.st_size >= INDEX_IN_BACKGROUND) block->startIndexing();
+    } else {
+        std::string text;
+        char buf[64 * 1024];
+        ssize_t nread = 0;
+        while ((nread = read(fd, buf, sizeof(buf))) > 0) text.append(buf, nread);
+        if (nread == -1) return nullptr;
+        block = new TextBlock(text.size());
+        block->append(text.data(), text.size());
+    }
+    return block;
+}
 
-    editorSetStatusMessage("Help: ctrl+q=quit, ctrl+s=save, ctrl+f=search");
+// the block read from the file in state st becomes the whole buffer
+void editorLoadFile(TextBlock *block, const struct stat &st) {
+    block->retain();
+    if (config.base) config.base->release();
+    config.base = nullptr;
+    if (block->mapped) {
+        block->retain();
+        config.base = block;
+        config.base_st = st;
+    }
+    config.document.load(block);
+    config.file_size = block->size;
+    block->release();
+    editorClearRows();
+    config.wrap.clear();
+    config.syntax_states.clear();
+    config.dirty = false;
+}
 
+// reads the file again after it was rotated. the undo history and the
+// journal were about the old text, so they start over
+bool editorReload() {
+    int fd = open(config.filename, O_RDONLY);
+    if (fd == -1) return false;
+    struct stat st;
+    TextBlock *block = fstat(fd, &st) == 0 ? editorReadFile(fd, st) : nullptr;
+    close(fd);
+    if (block == nullptr) return false;
+    editorCancelSearch();
+    editorLoadFile(block, st);
+    config.undo.clear();
+    if (config.journal.isOpen()) config.journal.reset(st);
+    config.n_rows = config.document.lineCount();
+    editorJumpTo(max(config.n_rows - 1, 0), 0);
+    return config.follow.start(config.filename, st.st_size);
 }
 
 void editorOpen(const char *filename) {
@@ -789,32 +6286,95 @@ void editorOpen(const char *filename) {
     size_t filename_length = strlen(filename);
     config.filename = new char[filename_length + 1];
     strcpy(config.filename, filename);
+    editorSelectSyntax();
 
-    FILE *fp = fopen(filename, "r");
-    if (fp == nullptr) die("fopen");
-    char *line = nullptr;
-    size_t linecap = 0;
-    ssize_t linelen = 0;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--;
-        config.editor_rows[config.n_rows++] = EditorRow(line, linelen);
-    }
-    free(line);
-    fclose(fp);
-    config.dirty = false;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) die("open");
+    struct stat st;
+    if (fstat(fd, &st) == -1) die("fstat");
+    if (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode) || S_ISSOCK(st.st_mode)) {
+        // the text arrives while we run, and there is no file to save it to
+        config.loader = new StreamLoader(fd, filename);
+        delete[] config.filename;
+        config.filename = nullptr;
+        return;
+    }
+    TextBlock *block = editorReadFile(fd, st);
+    if (block == nullptr) die("read");
+    close(fd);
+    editorLoadFile(block, st);
+
+    // edits that never made it into the file come back from the journal
+    long long recovered = config.journal.recover(filename, st, [](char type, size_t at, const char *str, size_t length) {
+        Document &document = config.document;
+        if (at > document.size() || (type == 'E' && length > document.size() - at)) return false;
+        if (type == 'I') document.insert(at, str, length);
+        else document.erase(at, length);
+        return true;
+    });
+    if (recovered > 0) {
+        config.dirty = true;
+        editorSetStatusMessage("Recovered %lld edits from %s", recovered, config.journal.path.c_str());
+    } else if (recovered == -2) {
+        // starting over would truncate it
+        editorSetStatusMessage("%s is for another version of the file and can't be moved, edits are not crash safe",
+                               Journal::pathFor(filename).c_str());
+    } else if (recovered < 0 && !config.journal.start(filename, st)) {
+        editorSetStatusMessage("No journal, edits are not crash safe: %s", strerror(errno));
+    } else if (recovered < 0 && !config.journal.kept.empty()) {
+        editorSetStatusMessage("The journal was for another version of the file, kept it as %s",
+                               config.journal.kept.c_str());
+    }
+    config.n_rows = config.document.lineCount();
 }
 
 int main(int argc, char **argv) {
+    const char *filename = nullptr;
+    bool follow = false, wrap = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--follow") == 0) {
+            follow = true;
+        } else if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--wrap") == 0) {
+            wrap = true;
+        } else if (strcmp(argv[i], "--osc52") == 0) {
+            config.osc52 = true;
+        } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            config.max_fps = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--undo-limit") == 0 && i + 1 < argc) {
+            // in megabytes
+            config.undo.limit = (size_t)max(0, atoi(argv[++i])) << 20;
+        } else {
+            filename = argv[i];
+        }
+    }
+    // with `-` the text comes from stdin and the keys from the terminal
+    int stream = -1;
+    if (filename != nullptr && strcmp(filename, "-") == 0) {
+        stream = dup(STDIN_FILENO);
+        int tty = open("/dev/tty", O_RDWR);
+        if (stream == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1) {
+            fprintf(stderr, "ezeditor: can't read keys from /dev/tty\n");
+            exit(1);
+        }
+        close(tty);
+        fcntl(stream, F_SETFD, FD_CLOEXEC);
+    }
     editorInit();
-    if (argc >= 2) {
-        editorOpen(argv[1]);
+    config.soft_wrap = wrap;
+    config.wrap.width = config.terminal_width;
+    if (stream != -1) {
+        config.loader = new StreamLoader(stream, "[stdin]");
+    } else if (filename != nullptr) {
+        editorOpen(filename);
+        if (follow) editorToggleFollow();
     } else {
         // editorOpen("a.txt");
     }
     while (1) {
-        editorRefreshScreen();
+        // frames are drawn by editorReadKey whenever it runs out of keys
         int key = editorReadKey();
         editorProcessKey(key);
+        config.redraw = true;
     }
     return 0;
 }